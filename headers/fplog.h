@@ -11,6 +11,14 @@
 #include <algorithm>
 #include <mutex>
 #include <functional>
+#include <atomic>
+#include <cstdarg>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <string_view>
+#include <chrono>
+#include <cstring>
 
 #ifdef FPLOG_EXPORT
 
@@ -57,30 +65,65 @@ namespace fplog { std::string demangle_cpp_name(const char* mangled); };
     : __FUNCTION__ \
     )
     
-#ifndef _WIN32_WINNT
-
-#define FPL_TRACE(format, ...) fplog::Message(fplog::Prio::debug, fplog::get_facility(), format, ##__VA_ARGS__).set_module(__SHORT_FORM_OF_FILE__).set_line(__LINE__).set_method(FUNCTION_SHORT)
-#define FPL_INFO(format, ...) fplog::Message(fplog::Prio::info, fplog::get_facility(), format, ##__VA_ARGS__).set_module(__SHORT_FORM_OF_FILE__).set_line(__LINE__).set_method(FUNCTION_SHORT)
-#define FPL_WARN(format, ...) fplog::Message(fplog::Prio::warning, fplog::get_facility(), format, ##__VA_ARGS__).set_module(__SHORT_FORM_OF_FILE__).set_line(__LINE__).set_method(FUNCTION_SHORT)
-#define FPL_ERROR(format, ...) fplog::Message(fplog::Prio::error, fplog::get_facility(), format, ##__VA_ARGS__).set_module(__SHORT_FORM_OF_FILE__).set_line(__LINE__).set_method(FUNCTION_SHORT)
-
-#define FPL_CTRACE(format, ...) FPL_TRACE(format, ##__VA_ARGS__).set_class(CLASSNAME_SHORT)
-#define FPL_CINFO(format, ...) FPL_INFO(format, ##__VA_ARGS__).set_class(CLASSNAME_SHORT)
-#define FPL_CWARN(format, ...) FPL_WARN(format, ##__VA_ARGS__).set_class(CLASSNAME_SHORT)
-#define FPL_CERROR(format, ...) FPL_ERROR(format, ##__VA_ARGS__).set_class(CLASSNAME_SHORT)
+//Numeric priority levels for preprocessor checks, same values as fplog::Prio_Level.
+#define FPLOG_LEVEL_EMERGENCY 0
+#define FPLOG_LEVEL_ALERT 1
+#define FPLOG_LEVEL_CRITICAL 2
+#define FPLOG_LEVEL_ERROR 3
+#define FPLOG_LEVEL_WARNING 4
+#define FPLOG_LEVEL_NOTICE 5
+#define FPLOG_LEVEL_INFO 6
+#define FPLOG_LEVEL_DEBUG 7
+
+//Least important priority that is still compiled in, define it before including fplog.h
+//(or pass -DFPLOG_MIN_LEVEL=FPLOG_LEVEL_WARNING to the compiler) to strip trace/info logging from the build.
+//Macros below the minimum expand to Message::filtered_out() and their arguments are never evaluated.
+#ifndef FPLOG_MIN_LEVEL
+#define FPLOG_MIN_LEVEL FPLOG_LEVEL_DEBUG
+#endif
 
+//FPL_* macros check the level gate of the calling thread before building anything,
+//statements filtered out by priority cost one load and one branch and yield Message::filtered_out().
+//Module, line, method and class of every statement are resolved once and kept in a function-local static Call_Site.
+//The result refers to a temporary destroyed at the end of the full expression (or to the Message::filtered_out() placeholder),
+//so it may only be passed straight to write(), add() and set_*() could be chained before that. Do not bind it to a reference
+//of any kind, to keep the message construct a Message from it: fplog::Message msg(FPL_INFO("text"));
+#define FPL_CALL_SITE_ ([](const char* file, const char* function) -> const fplog::Call_Site& { static const fplog::Call_Site site(file, __LINE__, function); return site; }(__FILE__, __FUNCTION__))
+#define FPL_MESSAGE_(level, ...) fplog::Message(level, fplog::get_facility(), __VA_ARGS__).set_call_site(FPL_CALL_SITE_)
+#define FPL_CMESSAGE_(level, ...) fplog::Message(level, fplog::get_facility(), __VA_ARGS__).set_call_site(FPL_CALL_SITE_, typeid(*this))
+#define FPL_GATED_(level, message) (fplog::level_gate_open(level) ? std::move(message) : std::move(fplog::Message::filtered_out()))
+#define FPL_COMPILED_OUT_(...) std::move(fplog::Message::filtered_out())
+
+#if FPLOG_MIN_LEVEL >= FPLOG_LEVEL_DEBUG
+#define FPL_TRACE(...) FPL_GATED_(fplog::Prio_Level::debug, FPL_MESSAGE_(fplog::Prio_Level::debug, __VA_ARGS__))
+#define FPL_CTRACE(...) FPL_GATED_(fplog::Prio_Level::debug, FPL_CMESSAGE_(fplog::Prio_Level::debug, __VA_ARGS__))
 #else
+#define FPL_TRACE FPL_COMPILED_OUT_
+#define FPL_CTRACE FPL_COMPILED_OUT_
+#endif
 
-#define FPL_TRACE(format, ...) fplog::Message(fplog::Prio::debug, fplog::get_facility(), format, __VA_ARGS__).set_module(__SHORT_FORM_OF_FILE__).set_line(__LINE__).set_method(FUNCTION_SHORT)
-#define FPL_INFO(format, ...) fplog::Message(fplog::Prio::info, fplog::get_facility(), format, __VA_ARGS__).set_module(__SHORT_FORM_OF_FILE__).set_line(__LINE__).set_method(FUNCTION_SHORT)
-#define FPL_WARN(format, ...) fplog::Message(fplog::Prio::warning, fplog::get_facility(), format, __VA_ARGS__).set_module(__SHORT_FORM_OF_FILE__).set_line(__LINE__).set_method(FUNCTION_SHORT)
-#define FPL_ERROR(format, ...) fplog::Message(fplog::Prio::error, fplog::get_facility(), format, __VA_ARGS__).set_module(__SHORT_FORM_OF_FILE__).set_line(__LINE__).set_method(FUNCTION_SHORT)
+#if FPLOG_MIN_LEVEL >= FPLOG_LEVEL_INFO
+#define FPL_INFO(...) FPL_GATED_(fplog::Prio_Level::info, FPL_MESSAGE_(fplog::Prio_Level::info, __VA_ARGS__))
+#define FPL_CINFO(...) FPL_GATED_(fplog::Prio_Level::info, FPL_CMESSAGE_(fplog::Prio_Level::info, __VA_ARGS__))
+#else
+#define FPL_INFO FPL_COMPILED_OUT_
+#define FPL_CINFO FPL_COMPILED_OUT_
+#endif
 
-#define FPL_CTRACE(format, ...) FPL_TRACE(format, __VA_ARGS__).set_class(CLASSNAME_SHORT)
-#define FPL_CINFO(format, ...) FPL_INFO(format, __VA_ARGS__).set_class(CLASSNAME_SHORT)
-#define FPL_CWARN(format, ...) FPL_WARN(format, __VA_ARGS__).set_class(CLASSNAME_SHORT)
-#define FPL_CERROR(format, ...) FPL_ERROR(format, __VA_ARGS__).set_class(CLASSNAME_SHORT)
+#if FPLOG_MIN_LEVEL >= FPLOG_LEVEL_WARNING
+#define FPL_WARN(...) FPL_GATED_(fplog::Prio_Level::warning, FPL_MESSAGE_(fplog::Prio_Level::warning, __VA_ARGS__))
+#define FPL_CWARN(...) FPL_GATED_(fplog::Prio_Level::warning, FPL_CMESSAGE_(fplog::Prio_Level::warning, __VA_ARGS__))
+#else
+#define FPL_WARN FPL_COMPILED_OUT_
+#define FPL_CWARN FPL_COMPILED_OUT_
+#endif
 
+#if FPLOG_MIN_LEVEL >= FPLOG_LEVEL_ERROR
+#define FPL_ERROR(...) FPL_GATED_(fplog::Prio_Level::error, FPL_MESSAGE_(fplog::Prio_Level::error, __VA_ARGS__))
+#define FPL_CERROR(...) FPL_GATED_(fplog::Prio_Level::error, FPL_CMESSAGE_(fplog::Prio_Level::error, __VA_ARGS__))
+#else
+#define FPL_ERROR FPL_COMPILED_OUT_
+#define FPL_CERROR FPL_COMPILED_OUT_
 #endif
 
 namespace fplogd
@@ -111,10 +154,204 @@ struct FPLOG_API Prio
     static const char* debug; //debug/trace info for developers
 };
 
+//Numeric counterparts of Prio constants, same order as syslog severities.
+struct Prio_Level
+{
+    enum Type
+    {
+        emergency = 0,
+        alert,
+        critical,
+        error,
+        warning,
+        notice,
+        info,
+        debug
+    };
+};
+
+static_assert((Prio_Level::emergency == FPLOG_LEVEL_EMERGENCY) && (Prio_Level::error == FPLOG_LEVEL_ERROR) &&
+              (Prio_Level::warning == FPLOG_LEVEL_WARNING) && (Prio_Level::info == FPLOG_LEVEL_INFO) &&
+              (Prio_Level::debug == FPLOG_LEVEL_DEBUG), "FPLOG_LEVEL_* macros are out of sync with Prio_Level");
+
+//Level gates: bit N is set if a message of Prio_Level N could pass the filters, bit 8 is set if there are any filters.
+//Per-thread gate follows filters of the calling thread, shared gate follows filters added by add_shared_filter(),
+//gate without filters keeps all level bits set. Message could pass only if both gates let it through and at least one has filters.
+//Kept in sync with filters by fplog, threads that did not call openlog() have all bits of their own gate set.
+const unsigned short level_gate_has_filters = 0x100;
+
+#ifndef _WIN32_WINNT
+FPLOG_API extern thread_local std::atomic<unsigned short> g_level_gate;
+FPLOG_API extern std::atomic<unsigned short> g_shared_level_gate;
+
+inline bool level_gate_open(int level)
+{
+    unsigned short gate = g_level_gate.load(std::memory_order_relaxed);
+    unsigned short shared = g_shared_level_gate.load(std::memory_order_relaxed);
+
+    return ((gate & shared & (1 << level)) != 0) && (((gate | shared) & level_gate_has_filters) != 0);
+}
+#else
+FPLOG_API bool level_gate_open(int level);
+#endif
+
+//Format string and arguments of a log message captured as raw bytes, to be formatted later by fplog's background thread.
+//Only arithmetic types, enums, C strings and pointers are accepted, anything else fails to compile.
+//C strings and the format string itself are copied, so they do not have to outlive the message. Capture does not allocate,
+//the caller asks for the size first and provides the buffer, Message takes it from its own memory pool.
+class FPLOG_API Deferred_Text
+{
+    public:
+
+        template <typename... Args> static size_t capture_size(const char* format, Args... args)
+        {
+            return strlen(format ? format : "") + 1 + (arg_size(args) + ... + 0);
+        }
+
+        //Writes exactly capture_size(format, args...) bytes into the buffer.
+        template <typename... Args> static void capture(char* buffer, const char* format, Args... args)
+        {
+            if (!format)
+                format = "";
+
+            size_t length = strlen(format) + 1;
+            memcpy(buffer, format, length);
+            buffer += length;
+
+            (capture_arg(buffer, args), ...);
+        }
+
+        //Produces the same text as snprintf(format, args...) would have produced at the call site.
+        static std::string format(const char* captured, size_t size);
+
+
+    private:
+
+        Deferred_Text(const char* captured, size_t size);
+
+        enum Arg_Type: char
+        {
+            int_arg, //integers not wider than int, the same way C varargs promote them
+            unsigned_int_arg,
+            signed_arg,
+            unsigned_arg,
+            double_arg,
+            long_double_arg,
+            string_arg,
+            null_string_arg,
+            pointer_arg
+        };
+
+        const char* format_;
+        const char* args_; //type tag followed by the value for every argument, strings are stored with terminating zero
+        size_t args_size_;
+
+        //Type tag and the value an argument is stored as.
+        template <typename T> static auto promote(T arg)
+        {
+            static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value || std::is_pointer<T>::value,
+                          "log message arguments must be arithmetic types, enums, C strings or pointers");
+
+            if constexpr (std::is_same<T, long double>::value)
+                return std::make_pair(long_double_arg, arg);
+            else if constexpr (std::is_floating_point<T>::value)
+                return std::make_pair(double_arg, static_cast<double>(arg));
+            else if constexpr (std::is_pointer<T>::value)
+                return std::make_pair(pointer_arg, static_cast<const void*>(arg));
+            else if constexpr (std::is_enum<T>::value || (sizeof(T) < sizeof(int)) || (std::is_signed<T>::value && (sizeof(T) == sizeof(int))))
+                return std::make_pair(int_arg, static_cast<long long>(arg));
+            else if constexpr (sizeof(T) == sizeof(int))
+                return std::make_pair(unsigned_int_arg, static_cast<unsigned long long>(arg));
+            else if constexpr (std::is_signed<T>::value)
+                return std::make_pair(signed_arg, static_cast<long long>(arg));
+            else
+                return std::make_pair(unsigned_arg, static_cast<unsigned long long>(arg));
+        }
+
+        template <typename T> static size_t arg_size(T arg)
+        {
+            return 1 + sizeof(promote(arg).second);
+        }
+
+        static size_t arg_size(const char* arg){ return arg ? strlen(arg) + 2 : 1; }
+        static size_t arg_size(char* arg){ return arg_size(const_cast<const char*>(arg)); }
+
+        template <typename T> static void capture_arg(char*& buffer, T arg)
+        {
+            auto stored(promote(arg));
+
+            *buffer++ = stored.first;
+            memcpy(buffer, &stored.second, sizeof(stored.second));
+            buffer += sizeof(stored.second);
+        }
+
+        static void capture_arg(char*& buffer, const char* arg)
+        {
+            if (!arg)
+            {
+                *buffer++ = null_string_arg;
+                return;
+            }
+
+            size_t length = strlen(arg) + 1;
+
+            *buffer++ = string_arg;
+            memcpy(buffer, arg, length);
+            buffer += length;
+        }
+
+        static void capture_arg(char*& buffer, char* arg){ capture_arg(buffer, const_cast<const char*>(arg)); }
+
+        std::string format() const;
+        void format_arg(std::string& text, std::string& spec, int h_count, char conversion, size_t& pos) const;
+        long long next_int(size_t& pos) const;
+};
+
+struct Class_Name;
+
+//Source location of an FPL_* statement, filled in once per statement.
+//Strings returned by the accessors live as long as the program, so messages refer to them without copying.
+class FPLOG_API Call_Site
+{
+    public:
+
+        Call_Site(const char* file, int line, const char* function);
+
+        const char* module() const { return module_; }
+        int line() const { return line_; }
+        const char* method() const { return method_; }
+
+        //Short class name of the given dynamic type, demangled once per type and remembered by the call site.
+        const char* class_name(const std::type_info& type) const;
+
+
+    private:
+
+        Call_Site(const Call_Site&);
+        Call_Site& operator=(const Call_Site&);
+
+        const char* module_;
+        int line_;
+        const char* method_;
+
+        mutable std::atomic<const Class_Name*> last_class_{nullptr}; //class name used last time at this call site
+};
+
+class Message;
+FPLOG_API void write(const Message& msg);
+FPLOG_API void write(Message&& msg);
+
+typedef std::function<void(unsigned long long sequence, bool delivered)> Receipt;
+FPLOG_API void write(Message&& msg, const Receipt& receipt);
+
 class FPLOG_API Message
 {
     friend class Fplog_Impl;
     friend class fplogd::Impl;
+    friend void write(const Message& msg);
+    friend void write(Message&& msg);
+    friend void write(Message&& msg, const Receipt& receipt);
+    friend class Priority_Filter;
 
     public:
 
@@ -149,21 +386,78 @@ class FPLOG_API Message
         };
 
         Message(const char* prio, const char *facility, const char* format = 0, ...);
+
+        //Format arguments are type checked at compile time, when deferred formatting is on (see change_config)
+        //they are captured into the memory pool of the message as is, and both the text and the timestamp
+        //(taken at capture time) are formatted by fplog's background thread.
+        template <typename... Args> Message(Prio_Level::Type prio, const char *facility, const char* format = 0, Args... args)
+        {
+            if (format && deferred_formatting_.load(std::memory_order_relaxed))
+            {
+                construct(prio, facility, false);
+
+                deferred_time_ = std::chrono::system_clock::now();
+                deferred_size_ = Deferred_Text::capture_size(format, args...);
+                deferred_text_ = static_cast<char*>(msg_.GetAllocator().Malloc(deferred_size_));
+                Deferred_Text::capture(deferred_text_, format, args...);
+
+                return;
+            }
+
+            construct(prio, facility);
+
+            if (format)
+                set_formatted_text(format, args...);
+        }
+
         Message(const rapidjson::Document& msg);
         Message(const std::string& msg);
 
         Message(const Message &obj)
         {
             validate_params_ = obj.validate_params_;
+            filtered_out_ = obj.filtered_out_;
+            prio_level_ = obj.prio_level_;
             msg_.CopyFrom(obj.msg_, msg_.GetAllocator());
+            copy_deferred(obj);
         }
         Message& operator= (const Message& rhs)
         {
             validate_params_ = rhs.validate_params_;
+            filtered_out_ = rhs.filtered_out_;
+            prio_level_ = rhs.prio_level_;
             msg_.CopyFrom(rhs.msg_, msg_.GetAllocator());
+            copy_deferred(rhs);
             return *this;
         }
 
+        //Moving exchanges documents together with their memory pools, nothing is copied.
+        //Moved-from message is left empty, it can only be assigned to or destroyed.
+        //Message::filtered_out() placeholder is shared by the thread, so it is copied instead.
+        Message(Message&& obj)
+        {
+            *this = std::move(obj);
+        }
+        Message& operator= (Message&& rhs)
+        {
+            if (rhs.filtered_out_)
+                return *this = static_cast<const Message&>(rhs);
+
+            std::swap(validate_params_, rhs.validate_params_);
+            std::swap(filtered_out_, rhs.filtered_out_);
+            std::swap(prio_level_, rhs.prio_level_);
+            std::swap(deferred_text_, rhs.deferred_text_);
+            std::swap(deferred_size_, rhs.deferred_size_);
+            std::swap(deferred_time_, rhs.deferred_time_);
+            block_.swap(rhs.block_);
+            msg_.Swap(rhs.msg_);
+            return *this;
+        }
+
+        //Per-thread placeholder returned by FPL_* macros when level gate is closed,
+        //all modifications of this message are ignored and write() drops it right away.
+        static Message& filtered_out();
+
         Message& set_timestamp(const char* timestamp = 0); //either sets provided timestamp or uses current system date/time if timestamp is 0
 
         Message& add(const char* param_name, int param){ return add<int>(param_name, param); }
@@ -196,9 +490,24 @@ class FPLOG_API Message
         Message& set_line(int line);
         Message& set_file(const char* name);
 
+        //Sets module, line, method and, if type is given, class of the message without copying any strings.
+        Message& set_call_site(const Call_Site& site);
+        Message& set_call_site(const Call_Site& site, const std::type_info& type);
+
         std::string as_string() const;
         rapidjson::Document as_json();
 
+        //Read-only access to fields without copying anything, views point into the message and are valid
+        //until the message is modified or destroyed. Missing or non-string fields give an empty view,
+        //text() and timestamp() are also empty while formatting of the text is deferred.
+        std::string_view priority() const { return find_string(Mandatory_Fields::priority); }
+        std::string_view facility() const { return find_string(Mandatory_Fields::facility); }
+        std::string_view timestamp() const { return find_string(Mandatory_Fields::timestamp); }
+        std::string_view text() const { return find_string(Optional_Fields::text); }
+        unsigned long long sequence() const; //0 if there is no sequence number yet
+        std::string_view find_string(const char* param_name) const;
+        const rapidjson::Value* find(const char* param_name) const; //nullptr if there is no such member
+
 
     private:
 
@@ -272,6 +581,9 @@ class FPLOG_API Message
 
         template <typename T> Message& add(const char* param_name, T param)
         {
+            if (filtered_out_)
+                return *this;
+
             std::string trimmed(param_name);
             trim(trimmed);
 
@@ -292,8 +604,56 @@ class FPLOG_API Message
         
         Message& set_sequence(unsigned long long int sequence);
 
-        rapidjson::Document msg_;
-        bool validate_params_;
+        //Memory pool of the message: pool allocator itself followed by its first chunk. Taken from a free list of the constructing
+        //thread and returned to the free list of the destroying thread, so that a typical message does not call malloc at all.
+        class FPLOG_API Arena_Block
+        {
+            public:
+
+                static constexpr size_t size = 2048; //fits a typical log record, bigger ones spill into chunk_size chunks
+                static constexpr size_t chunk_size = 4096;
+
+                Arena_Block();
+                ~Arena_Block();
+
+                rapidjson::MemoryPoolAllocator<>* allocator() { return allocator_; }
+                void swap(Arena_Block& other) noexcept { std::swap(allocator_, other.allocator_); }
+
+
+            private:
+
+                Arena_Block(const Arena_Block&);
+                Arena_Block& operator=(const Arena_Block&);
+
+                rapidjson::MemoryPoolAllocator<>* allocator_; //placed at the start of the block
+        };
+
+        static rapidjson::CrtAllocator& chunk_allocator(); //shared, so that the pool does not allocate its own
+
+        Arena_Block block_;
+        rapidjson::Document msg_{block_.allocator(), 256, &chunk_allocator()};
+        bool validate_params_ = true;
+        bool filtered_out_ = false;
+        int prio_level_ = -1; //Prio_Level of the message or -1 if priority is not one of Prio constants
+
+        char* deferred_text_ = nullptr; //captured by Deferred_Text in the memory pool of the message, see format_deferred()
+        size_t deferred_size_ = 0;
+        std::chrono::system_clock::time_point deferred_time_; //timestamp of the message while its text is deferred
+
+        static std::atomic<bool> deferred_formatting_;
+
+        void construct(const char* prio, const char* facility, bool timestamp = true);
+        void construct(Prio_Level::Type prio, const char* facility, bool timestamp = true);
+        void format_text(const char* format, va_list args);
+        void set_formatted_text(const char* format, ...);
+        void format_deferred(); //sets text and timestamp from deferred_text_, if any
+        void copy_deferred(const Message& obj);
+
+        //Adds or replaces a member referring to static strings, reserved names are allowed here.
+        void set_static(const char* param_name, const char* param);
+        void set_static(const char* param_name, int param);
+        static int prio_level(const char* prio);
+        void find_prio_level();
 
         static std::vector<std::string> reserved_names_;
         static void one_time_init();
@@ -325,61 +685,86 @@ class FPLOG_API Filter_Base
         std::string get_id(){ std::lock_guard<std::recursive_mutex> lock(mutex_); std::string id(filter_id_); return id; };
         virtual ~Filter_Base() {}
 
+        //Priorities this filter could possibly let through, bit N stands for Prio_Level N.
+        //Used to build level gate of the thread that owns the filter, filters that do not look at priority keep all bits set.
+        virtual unsigned char level_mask() { return 0xFF; }
+
+        //Set by fplog when filter is attached to a thread, filters call changed() after their level_mask() changes.
+        void set_change_handler(std::function<void()> handler){ std::lock_guard<std::recursive_mutex> lock(mutex_); change_handler_ = handler; }
+
 
     protected:
 
         std::string filter_id_; //just a human-readable name for the filter
         std::recursive_mutex mutex_;
 
+        void changed()
+        {
+            std::function<void()> handler;
+
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                handler = change_handler_;
+            }
+
+            if (handler)
+                handler();
+        }
+
 
     private:
 
         Filter_Base();
+        std::function<void()> change_handler_;
 };
 
 //You need to explicitly state messages of which priorities you need to log by using add/remove.
+//Allowed priorities are kept as Prio_Level bits, so checking a message is a single AND.
 class FPLOG_API Priority_Filter: public Filter_Base
 {
     public:
 
-        Priority_Filter(const char* filter_id): Filter_Base(filter_id){ construct_numeric(); }
+        Priority_Filter(const char* filter_id): Filter_Base(filter_id){}
         virtual ~Priority_Filter() {}
 
         virtual bool should_pass(const Message& msg);
+        virtual unsigned char level_mask() { return mask_.load(std::memory_order_relaxed); }
 
-        void add(const char* prio){ if (prio) prio_.insert(prio); }
-        void remove(const char* prio = nullptr) //by default removes all
-        {
-            if (prio){ std::set<std::string>::iterator it(prio_.find(prio)); if (it != prio_.end()) { prio_.erase(it); }}
-            else
-                prio_.clear();
-        }
+        void add(const char* prio);
+        void add(Prio_Level::Type prio);
+        void remove(const char* prio = nullptr); //by default removes all
+        void remove(Prio_Level::Type prio);
 
+        //Priorities are matched by substring here, so that "warn" stands for "warning".
         void add_all_above(const char* prio, bool inclusive = false);
         void add_all_below(const char* prio, bool inclusive = false);
 
 
     private:
 
-        std::set<std::string> prio_;
-        std::vector<std::string> prio_numeric_;
-        
-        void construct_numeric();
+        std::atomic<unsigned char> mask_{0};
+        std::set<std::string> custom_prio_; //priorities that are not Prio constants, checked only for messages without Prio_Level, guarded by mutex_
+
+        void set_mask(unsigned char mask);
+        void clear_custom_prio();
+        static int find_level(const char* prio, bool least_important_first);
 };
 
 //One time per application call.
 //async_logging means that log messages are going to the queue before dispatching to the destination.
 //This process is faster than sync logging but it also means that if app crashes with some messages still
 //in the queue, those messages are lost. If you need to debug some app crash, set this parameter to false
-//until you find the reason for the crash.
+//until you find the reason for the crash or keep the queue in a file with persistent_queue (see change_config).
 FPLOG_API void initlog(const char* appname, sprot::Basic_Transport_Interface* transport, bool async_logging = true);
 FPLOG_API void initlog(const char* appname, sprot::Address local, sprot::Address remote, bool async_logging = true);
 
 //One time per application call to stop logging from an application and free all associated resources.
+//Other threads could still be logging: write(), flush() and get_facility() calls that are in progress when shutdownlog() starts
+//are waited for (flush() returns false right away), messages written from now on are dropped. Must not be called from a receipt.
 FPLOG_API void shutdownlog();
 
-//Mandatory call from every thread that wants to log some data. Done to increase flexibility:
-//each thread will have its own filters configuration and can decide independently which stuff to log.
+//Mandatory call from every thread that wants to log some data, unless shared filters are enough for the thread.
+//Done to increase flexibility: each thread will have its own filters configuration and can decide independently which stuff to log.
 //Each filter within one thread must have unique id.
 FPLOG_API void openlog(const char* facility, Filter_Base* filter = 0);
 
@@ -390,16 +775,58 @@ FPLOG_API void openlog(const char* facility, Filter_Base* filter = 0);
 FPLOG_API void closelog();
 
 //Scope of filter-related functions is a calling thread - all manipulations will apply to calling thread only.
+//Filters of a thread are published as a snapshot which the thread reads without locks while logging,
+//so reconfiguring filters at runtime, even from other threads, does not stall the logging one. Removed filters are deallocated
+//once the thread that owned them notices the change.
 //fplog will take ownership of the filter on adding and will deallocate it on removing, closelog() or shutdownlog().
 FPLOG_API void add_filter(Filter_Base* filter);
 FPLOG_API void remove_filter(Filter_Base* filter);
 FPLOG_API Filter_Base* find_filter(const char* filter_id);
 
+//Shared filters apply to all threads, including those that never called openlog(), and are checked before filters of the thread.
+//Thread filters could only narrow down what shared filters let through, threads without filters of their own rely on shared ones.
+//Changing a shared filter is a single operation regardless of the number of threads, ownership rules are the same as above.
+FPLOG_API void add_shared_filter(Filter_Base* filter);
+FPLOG_API void remove_shared_filter(Filter_Base* filter);
+FPLOG_API Filter_Base* find_shared_filter(const char* filter_id);
+
 FPLOG_API const char* get_facility();
 
 //Should be used from any thread that opened logger, calling from other threads will have no effect.
+//FPL_* macros yield rvalues, those messages are moved into the queue instead of being copied.
 FPLOG_API void write(const Message& msg);
-
+FPLOG_API void write(Message&& msg);
+
+//Delivery receipt is called with the sequence number of the message (see Message::set_sequence)
+//once the transport accepted it or with delivered = false if the message was filtered out, dropped or the log was shut down first.
+//In async mode receipts are called from fplog's background thread and should return quickly,
+//otherwise they are called by write() itself once it released its locks.
+FPLOG_API void write(Message&& msg, const Receipt& receipt);
+
+//Blocks until every message written by any thread before the call has been accepted by the transport or dropped,
+//timeout is in ms. Returns false on timeout. Call it before shutdownlog(), which drops anything still queued.
+FPLOG_API bool flush(size_t timeout = sprot::Basic_Transport_Interface::infinite_wait);
+
+//Configuration params handled by fplog itself are listed below, the rest is passed to Queue_Controller::apply_config().
+//thread_queues = true/false //in async mode each thread that called openlog() writes into its own lock-free queue
+//thread_queue_capacity = [any positive integer] //max messages in one per-thread queue, applies to threads opened afterwards
+//deferred_formatting = true/false //FPL_* macros capture format arguments instead of formatting the text right away,
+//                                  //with thread_queues the text is formatted by the background thread, otherwise after filtering
+//sequence_lease_size = [0 or any positive integer] //0 keeps strict host-wide ordering of sequence numbers,
+//                                                    //otherwise each thread leases that many numbers at once
+//batch_size = [0, mtu or any positive integer] //in async mode queued messages are sent as batch messages (see Message::add_batch)
+//                                               //of up to that many bytes, mtu stands for the protocol MTU, 0 turns batching off
+//batch_latency = [0 or any positive integer] //max latency in ms batching could add to a message, error and higher priorities never wait
+//batch_adaptive = true/false //batch target size grows with queue depth and shrinks when batches are not filled within batch_latency,
+//                             //false makes every batch wait for batch_size bytes or batch_latency, true by default
+//drop_report_interval = [0 or any positive integer] //min interval in ms between warnings from Facility::fplog that tell how many
+//                                                   //messages of each priority queue drop policies and full per-thread queues dropped,
+//                                                   //10000 by default, 0 turns them off
+//persistent_queue = [file path] //in async mode messages are queued in a memory-mapped file instead of memory, so they survive
+//                                //a crash of the app, messages left there by a previous run are sent first,
+//                                //takes effect once per process, per-thread queues and queue drop policies are not used with it
+//persistent_queue_size = [any positive integer] //size of a new persistent queue file in bytes, 64 MiB by default,
+//                                                //messages that do not fit are queued in memory
 FPLOG_API void change_config(const sprot::Params& config);
 
 };
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <atomic>
+#include <memory>
+
+//Tells how many bytes queues could take without pushing the process towards the memory limit of its container.
+//Limit is the lower of memory.max and memory.high of a cgroup v2 directory, usage is memory.current of the same directory
+//or, if that could not be read, resident set size of the process. Queued bytes are part of the usage, so that queues
+//never get more than their share of what is left under the limit, no matter how much they already hold.
+//Budget is process-wide: queues configured the same way share one instance (see shared()), which sums up what they hold,
+//and each of them gets what is left of the budget after the others.
+class Memory_Budget
+{
+    public:
+
+        //cgroup_dir could be "auto" for the cgroup of this process, share is the percentage of memory left under the limit
+        //that queued messages are allowed to take.
+        Memory_Budget(const std::string& cgroup_dir, unsigned int share = 50);
+
+        //Instance for all queues of the process with the same cgroup_dir and share.
+        static std::shared_ptr<Memory_Budget> shared(const std::string& cgroup_dir, unsigned int share = 50);
+
+        //Max bytes for all queues together, which already hold queued bytes, returns false if there is no limit or it could not be read.
+        bool budget(size_t queued, size_t& out) const;
+
+        //Max bytes for one of the queues sharing this instance, which holds queued bytes now. Reported is what the queue told
+        //last time (0 at first), it is updated here. Sizes of other queues are the ones they reported on their last call.
+        bool queue_budget(size_t queued, size_t& reported, size_t& out);
+
+        //Takes back what a queue reported when it stops using this instance.
+        void release(size_t& reported);
+
+        const std::string& dir() const { return dir_; }
+
+        //Reads a single number from a cgroup file, "max" (no limit) reads as false.
+        static bool read_value(const std::string& path, unsigned long long& out);
+
+        //Resident set size of this process in bytes.
+        static bool process_rss(unsigned long long& out);
+
+        //cgroup v2 directory of this process under /sys/fs/cgroup, empty if it is not in a unified hierarchy.
+        static std::string own_cgroup_dir();
+
+
+    private:
+
+        Memory_Budget(const Memory_Budget&);
+        Memory_Budget& operator=(const Memory_Budget&);
+
+        std::string dir_;
+        unsigned int share_;
+        std::atomic<size_t> queued_{0}; //sum of what the queues reported
+};
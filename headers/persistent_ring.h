@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <atomic>
+#include <cstddef>
+
+//Ring of records kept in a memory-mapped file, so that records survive a crash of the process that wrote them.
+//A record is visible once push() returns: its bytes are written to the shared mapping before the tail is moved,
+//so page cache holds it even if the process dies right after. Records stay in the file until commit() says they were delivered,
+//opening an existing file brings back everything that was not committed, possibly including records that were sent
+//right before the crash, so delivery is at least once. Does not protect against power loss or OS crash, nothing is synced to disk.
+//File is locked while open, a second user of the same file (in this or another process) gets is_open() == false.
+//Not thread safe, owner provides locking.
+class Persistent_Ring
+{
+    public:
+
+        //Capacity of an existing file wins over the given one, so that its records are not lost.
+        Persistent_Ring(const std::string& path, size_t capacity);
+        ~Persistent_Ring();
+
+        bool is_open() const { return header_ != nullptr; }
+
+        //Returns false if there is not enough free space in the ring.
+        bool push(const char* data, size_t size);
+
+        //Next record that was not read yet, returns false if there is none. Read records stay in the ring until committed.
+        bool read(std::string& out);
+
+        //Frees the given number of oldest read records.
+        void commit(size_t count);
+
+        bool has_unread() const { return is_open() && (read_pos_ != header_->tail.load(std::memory_order_relaxed)); }
+        size_t recovered() const { return recovered_; } //records that were in the file when it was opened
+
+
+    private:
+
+        Persistent_Ring(const Persistent_Ring&);
+        Persistent_Ring& operator=(const Persistent_Ring&);
+
+        struct File_Header
+        {
+            unsigned long long magic;
+            unsigned long long capacity;
+            std::atomic<unsigned long long> head; //stream offset of the oldest record that was not committed
+            std::atomic<unsigned long long> tail; //stream offset right after the newest record
+        };
+
+        struct Record_Header
+        {
+            unsigned int magic;
+            unsigned int size;
+        };
+
+        static constexpr unsigned long long file_magic = 0x31474e49524c5046ULL; //"FPLRING1"
+        static constexpr unsigned int record_magic = 0x4c504652; //"RFPL"
+        static constexpr size_t data_offset = 4096; //records start on the page after the file header
+
+        int fd_ = -1;
+        File_Header* header_ = nullptr;
+        char* data_ = nullptr;
+        size_t capacity_ = 0;
+        size_t map_size_ = 0;
+
+        unsigned long long read_pos_ = 0;
+        std::deque<unsigned long long> read_ends_; //where each read but not committed record ends
+        size_t recovered_ = 0;
+
+        void copy_in(unsigned long long pos, const char* data, size_t size);
+        void copy_out(unsigned long long pos, char* data, size_t size) const;
+        void recover();
+};
@@ -1,9 +1,14 @@
 #include <string>
 #include <queue>
+#include <deque>
+#include <vector>
 #include <memory>
 #include <chrono>
 #include <sprot.h>
 
+class Spill_Store;
+class Memory_Budget;
+
 #ifdef FPLOG_EXPORT
 
 #ifdef __linux__
@@ -29,10 +34,22 @@
 using namespace std::chrono;
 using namespace std;
 
+//Messages are kept in one lane per priority (see fplog::Prio_Level) plus one lane for messages without a known priority.
+//front() and pop() serve lanes by smooth weighted round-robin, so more important messages bypass a backlog of less important ones
+//while less important lanes still get their share. Emergency algorithms take messages from lanes directly, without scanning.
+//Messages of a lane are copied back to back into slabs, each one after a length header, slabs are reused once drained.
+//Spill_To_Disk algorithm moves newest messages to disk instead of dropping them, while anything is on disk
+//new messages go there as well and are read back in order once the queue is drained below half of its size limit.
+//With memory_limit_dir set, size limit follows the memory left under the limit of the container (see Memory_Budget),
+//while it is below max_queue_size emergency algorithms run as soon as the queue is over it, without waiting for emergency_timeout.
+//All queues of the process with the same memory_limit_dir and memory_limit_share take their budget together.
 class FPLOG_API Queue_Controller
 {
     public: 
 
+        static constexpr int lane_count = 9;
+        static constexpr int unknown_lane = lane_count - 1;
+
         class Algo
         {
             public:
@@ -52,7 +69,7 @@ class FPLOG_API Queue_Controller
                     };
                 };
                 
-                Algo(queue<string*>& mq, size_t max_size, size_t current_size = 0): mq_(mq), max_size_(max_size), current_size_(static_cast<int>(current_size)){}
+                Algo(Queue_Controller& qc): qc_(qc) {}
                 virtual Result process_queue(size_t current_size) = 0;
 
 
@@ -63,29 +80,49 @@ class FPLOG_API Queue_Controller
 
             protected:    
             
-                queue<string*>& mq_;
-                size_t max_size_;
-                int current_size_;
+                Queue_Controller& qc_;
+
+                //Removes messages from the allowed lanes while queue is over its size limit,
+                //least important lane first or the oldest/newest message across lanes if by_priority is false.
+                //Queue keeps its exact size itself, current_size passed to process_queue() is only informational.
+                Result remove(unsigned short lanes_mask, bool oldest, bool by_priority);
         };
 
         class FPLOG_API Remove_Oldest: public Algo
         {
             public:
                     
-                    Remove_Oldest(Queue_Controller& qc): Algo(qc.mq_, qc.max_size_, qc.mq_size_) {}
+                    Remove_Oldest(Queue_Controller& qc): Algo(qc) {}
                     Result process_queue(size_t current_size);
         };        
 
         class FPLOG_API Remove_Newest;
         class FPLOG_API Remove_Newest_Below_Priority;
         class FPLOG_API Remove_Oldest_Below_Priority;
+        class FPLOG_API Spill_To_Disk;
 
         Queue_Controller(size_t size_limit = 20000000, size_t timeout = 30000);
+        ~Queue_Controller();
+
+        struct Read_Result
+        {
+            size_t count = 0; //messages appended
+            bool flush = false; //stopped after a message of flush_prio or more important one
+        };
 
         bool empty();
-        string *front();
+        size_t size() { return mq_size_; } //bytes of all queued messages, not counting slab overhead
+
+        string *front(); //copy of the next message, owned by the caller
         void pop();
-        void push(string *str);
+
+        //Appends next messages to out, each one preceded by separator, while out stays within max_size,
+        //so that many queued messages end up in one buffer without allocating a string for each.
+        Read_Result read(std::string& out, size_t max_size, char separator, int flush_prio);
+
+        void push(string *str); //takes ownership of str
+        void push(string *str, int prio); //prio is Prio_Level of the message or -1 if unknown, saves looking it up in str
+        void push(const char* data, size_t size, int prio);
         
         void change_algo(std::shared_ptr<Algo> algo, Algo::Fallback_Options::Type fallback_algo);
         void change_params(size_t size_limit, size_t timeout);
@@ -93,27 +130,97 @@ class FPLOG_API Queue_Controller
         //configuration params as follows:
         //max_queue_size = [any positive integer]
         //emergency_timeout = [any positive integer]
-        //emergency_algo = one of { remove_oldest, remove_newest, remove_oldest_below_prio, remove_newest_below_prio }
+        //emergency_algo = one of { remove_oldest, remove_newest, remove_oldest_below_prio, remove_newest_below_prio, spill_to_disk }
         //emergency_fallback_algo = one of { remove_oldest, remove_newest }
         //emergency_prio = use one of the fplog::Prio constants //only needed if algo is based on prio
+        //spill_dir = [existing directory] //only needed for spill_to_disk, default is /tmp
+        //spill_max_size = [any positive integer] //bytes of disk spill_to_disk is allowed to use, default is 1 GiB
+        //memory_limit_dir = [cgroup v2 directory or auto] //e.g. /sys/fs/cgroup, auto stands for the cgroup of the process,
+        //                                                  //empty turns memory-aware sizing off, which is the default
+        //memory_limit_share = [0..100] //percent of memory left under the limit queues could take together, default is 50
+        //memory_check_interval = [0 or any positive integer] //min ms between reads of memory usage, default is 1000
         void apply_config(const sprot::Params& config);
 
+        //Lane of a serialized message, which is its Prio_Level or unknown_lane.
+        static int lane(const string& str);
+
+        //Adds counts of messages dropped by emergency algorithms since the previous call to counts, by lane, and resets them.
+        void collect_drops(unsigned long long (&counts)[lane_count]);
+
 
     private:
 
-        int mq_size_ = 0;
-        size_t max_size_ = 0;
+        Queue_Controller(const Queue_Controller&);
+        Queue_Controller& operator=(const Queue_Controller&);
+
+        //Everything algorithms need to know about a message, so that they never look inside the payload.
+        struct Entry
+        {
+            size_t size; //bytes of the message, its length header is not counted
+            unsigned long long order; //arrival order across all lanes
+            steady_clock::time_point enqueued;
+            int prio; //Prio_Level or unknown_lane
+        };
+
+        //Contiguous storage for messages of a lane, [begin, end) holds length headers followed by message bytes.
+        struct Slab
+        {
+            std::unique_ptr<char[]> data;
+            size_t capacity = 0;
+            size_t begin = 0;
+            size_t end = 0;
+        };
+
+        typedef unsigned int Length_Header;
 
-        queue<string*> mq_;
+        static constexpr size_t slab_size = 64 * 1024; //messages bigger than that get a slab of their own
+        static constexpr size_t max_free_slabs = 16;
+
+        size_t mq_size_ = 0;
+        size_t max_size_ = 0; //effective limit, configured_max_size_ or less under memory pressure
+        size_t configured_max_size_ = 0;
+
+        std::deque<Entry> lanes_[lane_count];
+        std::deque<Slab> slabs_[lane_count];
+        std::vector<Slab> free_slabs_;
+        unsigned long long next_order_ = 0;
+
+        unsigned long long dropped_[lane_count] = {}; //see collect_drops()
+
+        int credit_[lane_count] = {}; //smooth weighted round-robin state
+        int selected_ = -1; //lane front() returned the message from
 
         std::shared_ptr<Algo> algo_;
         std::shared_ptr<Algo> algo_fallback_;
 
+        std::shared_ptr<Spill_Store> spill_; //set by Spill_To_Disk, holds messages newer than anything in lanes_
+        std::string spill_dir_ = "/tmp";
+        size_t spill_max_size_ = 1024 * 1024 * 1024;
+
         size_t emergency_time_trigger_ = 0;
         time_point<system_clock, system_clock::duration> timer_start_;
 
+        std::shared_ptr<Memory_Budget> memory_;
+        unsigned int memory_share_ = 50;
+        size_t memory_check_interval_ = 1000;
+        steady_clock::time_point memory_checked_;
+        bool memory_pressure_ = false; //max_size_ was cut down to the memory budget
+        size_t memory_reported_ = 0; //mq_size_ as memory_ knows it
+
         bool state_of_emergency();
         void handle_emergency();
+        void check_memory();
+        int select_lane();
+        void charge(int lane);
+        Entry remove_from(int lane, bool oldest);
+        const char* front_data(int lane);
+        void tail_data(int lane, size_t count, std::vector<const char*>& data); //data of the last count messages, oldest first
+        void store(const char* data, size_t size, int prio);
+        bool spill(const char* data, size_t size, int prio);
+        void refill();
+        
+        Slab make_slab(size_t size);
+        void recycle(Slab& slab);
         
         std::shared_ptr<Algo> make_algo(const std::string& name, const std::string& param);
 };
@@ -123,7 +230,7 @@ class Queue_Controller::Remove_Newest: public Algo
 {
     public:
             
-            Remove_Newest(Queue_Controller& qc): Algo(qc.mq_, qc.max_size_, qc.mq_size_) {}
+            Remove_Newest(Queue_Controller& qc): Algo(qc) {}
             Result process_queue(size_t current_size);
 };
 
@@ -137,7 +244,7 @@ class Queue_Controller::Remove_Newest_Below_Priority: public Algo
     public:
         
             Remove_Newest_Below_Priority(Queue_Controller& qc, const char* prio, bool inclusive = false):
-            Algo(qc.mq_, qc.max_size_, qc.mq_size_), prio_(prio), inclusive_(inclusive) { make_filter(); }
+            Algo(qc), prio_(prio), inclusive_(inclusive) { make_filter(); }
             //~Remove_Newest_Below_Priority(){}
             
             Result process_queue(size_t current_size);
@@ -159,7 +266,7 @@ class Queue_Controller::Remove_Oldest_Below_Priority: public Algo
     public:
         
             Remove_Oldest_Below_Priority(Queue_Controller& qc, const char* prio, bool inclusive = false):
-            Algo(qc.mq_, qc.max_size_, qc.mq_size_), prio_(prio), inclusive_(inclusive) { make_filter(); }
+            Algo(qc), prio_(prio), inclusive_(inclusive) { make_filter(); }
             //~Remove_Oldest_Below_Priority(){}
             
             Result process_queue(size_t current_size);
@@ -175,3 +282,18 @@ class Queue_Controller::Remove_Oldest_Below_Priority: public Algo
             
             std::shared_ptr<fplog::Priority_Filter> filter_;
 };
+
+class Queue_Controller::Spill_To_Disk: public Algo
+{
+    public:
+
+            Spill_To_Disk(Queue_Controller& qc, const char* dir, size_t max_size);
+            Result process_queue(size_t current_size);
+
+
+    private:
+
+            Spill_To_Disk();
+
+            std::shared_ptr<Spill_Store> store_;
+};
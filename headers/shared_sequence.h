@@ -0,0 +1,24 @@
+#ifndef SHARED_SEQUENCE_H
+#define SHARED_SEQUENCE_H
+
+namespace sequence_number {
+
+//POSIX shared memory segment that holds host-wide 64-bit sequence counter,
+//created by the first process that asks for a sequence number and never removed after that,
+//so the numbers keep growing across process restarts until the host reboots.
+static const char* sequence_shm_name = "/fplog2_shared_sequence";
+
+//Returns next host-wide sequence number, 0 if shared memory segment is not available.
+//With lease size 0 every call from any process on this host gets a bigger number than all previous calls.
+//Otherwise each thread leases a block of numbers from the shared counter and hands them out locally,
+//numbers stay unique and increasing within a thread, but not in time across threads and processes.
+//Collector is still able to totally order messages by (sequence, appname).
+unsigned long long read_sequence_number();
+
+//0 (default) means strict host-wide ordering, any other value is the amount of numbers leased at once.
+void set_lease_size(unsigned long long size);
+unsigned long long get_lease_size();
+
+};
+
+#endif // SHARED_SEQUENCE_H
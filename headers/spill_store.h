@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <cstddef>
+
+//Append-only overflow storage on local disk for Queue_Controller.
+//Records are written one after another into a byte stream that is split into fixed size memory-mapped segment files,
+//a record could cross the boundary between two segments. Segment file is removed as soon as everything in it was read back.
+//Disk usage never goes over max_size rounded up to whole segments. Files are named after the process and the store,
+//so that several stores could share one directory, files that are left at destruction are removed as well.
+//Not thread safe, owner provides locking.
+class Spill_Store
+{
+    public:
+
+        Spill_Store(const std::string& dir, size_t max_size, size_t segment_size = 4 * 1024 * 1024);
+        ~Spill_Store();
+
+        //Returns false if record does not fit into the disk budget or segment file could not be created.
+        bool push(const char* data, size_t size, int prio);
+
+        //Makes sure records of the given total size (see record_size()) could be pushed without failing.
+        bool reserve(size_t size);
+
+        //Oldest record, returns false if there is none.
+        bool pop(std::string& out, int& prio);
+
+        bool empty() const { return read_pos_ == write_pos_; }
+        size_t size() const { return static_cast<size_t>(write_pos_ - read_pos_); } //bytes of records including headers
+        size_t available() const; //bytes of records that still fit
+
+        static size_t record_size(size_t size) { return sizeof(Record_Header) + size; }
+
+
+    private:
+
+        Spill_Store(const Spill_Store&);
+        Spill_Store& operator=(const Spill_Store&);
+
+        struct Record_Header
+        {
+            unsigned int size;
+            int prio;
+        };
+
+        struct Segment
+        {
+            std::string path;
+            char* addr;
+            unsigned long long base; //stream offset of the first byte
+        };
+
+        std::string dir_;
+        size_t segment_size_;
+        size_t max_segments_;
+        unsigned long long id_; //tells stores of the same process apart
+
+        std::deque<Segment> segments_;
+        unsigned long long next_segment_ = 0;
+
+        unsigned long long read_pos_ = 0;
+        unsigned long long write_pos_ = 0;
+
+        bool add_segment();
+        void drop_segment();
+
+        void write(const char* data, size_t size);
+        void read(char* data, size_t size);
+};
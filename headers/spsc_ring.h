@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+//Bounded single producer - single consumer ring, neither side takes any locks.
+//Only one thread is allowed to push and only one (possibly different) thread is allowed to pop.
+//Capacity is rounded up to the nearest power of 2.
+template <typename T> class Spsc_Ring
+{
+    public:
+
+        explicit Spsc_Ring(size_t capacity = 4096)
+        {
+            size_t rounded = 2;
+            while (rounded < capacity)
+                rounded <<= 1;
+
+            slots_.resize(rounded);
+            mask_ = rounded - 1;
+        }
+
+        //producer side, returns false if ring is full and item was not stored
+        bool push(const T& item)
+        {
+            size_t tail = tail_.load(std::memory_order_relaxed);
+
+            if (tail - cached_head_ > mask_)
+            {
+                cached_head_ = head_.load(std::memory_order_acquire);
+                if (tail - cached_head_ > mask_)
+                    return false;
+            }
+
+            slots_[tail & mask_] = item;
+            tail_.store(tail + 1, std::memory_order_release);
+
+            return true;
+        }
+
+        //consumer side, returns false if ring is empty
+        bool pop(T& item)
+        {
+            size_t head = head_.load(std::memory_order_relaxed);
+
+            if (head == cached_tail_)
+            {
+                cached_tail_ = tail_.load(std::memory_order_acquire);
+                if (head == cached_tail_)
+                    return false;
+            }
+
+            item = slots_[head & mask_];
+            head_.store(head + 1, std::memory_order_release);
+
+            return true;
+        }
+
+        bool empty() const { return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire); }
+        size_t capacity() const { return mask_ + 1; }
+
+
+    private:
+
+        Spsc_Ring(const Spsc_Ring&);
+        Spsc_Ring& operator=(const Spsc_Ring&);
+
+        //head and tail live on separate cache lines together with the opposite side's cached copy,
+        //so that producer and consumer do not invalidate each other's lines on every operation
+        alignas(64) std::atomic<size_t> head_{0}; //next slot to pop, written by consumer only
+        size_t cached_tail_ = 0; //consumer's last seen value of tail_
+
+        alignas(64) std::atomic<size_t> tail_{0}; //next slot to push, written by producer only
+        size_t cached_head_ = 0; //producer's last seen value of head_
+
+        alignas(64) std::vector<T> slots_;
+        size_t mask_ = 0;
+};
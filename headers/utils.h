@@ -11,6 +11,7 @@
 #include <queue>
 #include <thread>
 #include <mutex>
+#include <chrono>
 
 template<typename T>
 struct std::hash<std::vector<T>>
@@ -134,6 +135,9 @@ std::string timezone_from_minutes_to_iso8601(int tz_minute_bias);
 //Returns current local date-time in iso 8601 format including timezone information
 std::string get_iso8601_timestamp();
 
+//Same for a given point in time
+std::string get_iso8601_timestamp(std::chrono::system_clock::time_point tp);
+
 //Milliseconds elapsed since 01-Jan-1970
 unsigned long long get_msec_time();
 
@@ -11,8 +11,16 @@
 #include <rapidjson/allocators.h>
 #include <rapidjson/writer.h>
 #include <stdarg.h>
-#include <piped_sequence.h>
+#include <shared_sequence.h>
 #include <fplog_exceptions.h>
+#include <spsc_ring.h>
+#include <persistent_ring.h>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <condition_variable>
+#include <typeindex>
+#include <new>
 
 namespace fplog
 {
@@ -57,28 +65,401 @@ const char* Message::Optional_Fields::sequence = "sequence"; //sequence number t
                                                              //which message was first even if timestamps are the same
 const char* Message::Optional_Fields::batch = "batch"; //indicator if this message is actually a container for N other shorter messages
 
-Message::Message(const char* prio, const char *facility, const char* format, ...):
-msg_()
+//Prio constant for the given Prio_Level.
+static const char* prio_name(int level)
 {
-    msg_.SetObject();
+    static const char* names[] = { Prio::emergency, Prio::alert, Prio::critical, Prio::error, Prio::warning, Prio::notice, Prio::info, Prio::debug };
+    return names[level];
+}
 
-    set_timestamp();
-    set(Mandatory_Fields::priority, prio ? prio : Prio::debug);
-    set(Mandatory_Fields::facility, facility ? facility : Facility::user);
+Message::Message(const char* prio, const char *facility, const char* format, ...)
+{
+    construct(prio, facility);
+    prio_level_ = prio_level(prio ? prio : Prio::debug);
 
     if (format)
     {
         va_list aptr;
         va_start(aptr, format);
+        format_text(format, aptr);
+        va_end(aptr);
+    }
+}
 
-        char buffer[2048] = {0};
-        vsnprintf(buffer, sizeof(buffer) - 1, format, aptr);
-        set_text(buffer);
+std::atomic<bool> Message::deferred_formatting_(false);
 
-        va_end(aptr);
+//Free blocks of the calling thread, blocks over the limit go back to the heap.
+struct Arena_Free_List
+{
+    ~Arena_Free_List()
+    {
+        for (void* block : blocks)
+            free(block);
+
+        destroyed = true;
+    }
+
+    static const size_t max_blocks = 256;
+    std::vector<void*> blocks;
+
+    static thread_local bool destroyed; //messages that outlive thread-local storage free their blocks directly
+};
+
+thread_local bool Arena_Free_List::destroyed = false;
+static thread_local Arena_Free_List g_arena_free_list;
+
+//Pool allocator is followed by the first chunk, aligned the same way malloc aligns.
+static const size_t g_arena_header_size = (sizeof(rapidjson::MemoryPoolAllocator<>) + 15) & ~static_cast<size_t>(15);
+
+Message::Arena_Block::Arena_Block()
+{
+    void* data = 0;
+
+    if (!Arena_Free_List::destroyed && !g_arena_free_list.blocks.empty())
+    {
+        data = g_arena_free_list.blocks.back();
+        g_arena_free_list.blocks.pop_back();
+    }
+    else
+    {
+        data = malloc(size);
+        if (!data)
+            throw std::bad_alloc();
+    }
+
+    allocator_ = new (data) rapidjson::MemoryPoolAllocator<>(static_cast<char*>(data) + g_arena_header_size, size - g_arena_header_size,
+                                                             chunk_size, &chunk_allocator());
+}
+
+Message::Arena_Block::~Arena_Block()
+{
+    allocator_->~MemoryPoolAllocator();
+
+    if (Arena_Free_List::destroyed || (g_arena_free_list.blocks.size() >= Arena_Free_List::max_blocks))
+    {
+        free(allocator_);
+        return;
+    }
+
+    g_arena_free_list.blocks.push_back(allocator_);
+}
+
+rapidjson::CrtAllocator& Message::chunk_allocator()
+{
+    static rapidjson::CrtAllocator allocator;
+    return allocator;
+}
+
+void Message::construct(const char* prio, const char* facility, bool timestamp)
+{
+    msg_.SetObject();
+
+    if (timestamp)
+        set_timestamp();
+
+    set(Mandatory_Fields::priority, prio ? prio : Prio::debug);
+    set(Mandatory_Fields::facility, facility ? facility : Facility::user);
+}
+
+void Message::construct(Prio_Level::Type prio, const char* facility, bool timestamp)
+{
+    construct(prio_name(prio), facility, timestamp);
+    prio_level_ = prio;
+}
+
+void Message::format_text(const char* format, va_list args)
+{
+    char buffer[2048] = {0};
+    vsnprintf(buffer, sizeof(buffer) - 1, format, args);
+    set_text(buffer);
+}
+
+void Message::set_formatted_text(const char* format, ...)
+{
+    va_list aptr;
+    va_start(aptr, format);
+    format_text(format, aptr);
+    va_end(aptr);
+}
+
+void Message::format_deferred()
+{
+    if (!deferred_text_)
+        return;
+
+    if (!find(Mandatory_Fields::timestamp))
+        set_timestamp(generic_util::get_iso8601_timestamp(deferred_time_).c_str());
+
+    std::string text(Deferred_Text::format(deferred_text_, deferred_size_));
+    set_text(text);
+}
+
+void Message::copy_deferred(const Message& obj)
+{
+    deferred_text_ = nullptr;
+    deferred_size_ = obj.deferred_size_;
+    deferred_time_ = obj.deferred_time_;
+
+    if (!obj.deferred_text_)
+        return;
+
+    deferred_text_ = static_cast<char*>(msg_.GetAllocator().Malloc(deferred_size_));
+    memcpy(deferred_text_, obj.deferred_text_, deferred_size_);
+}
+
+template <typename T> static void append_formatted(std::string& text, const std::string& spec, T value)
+{
+    char buffer[256];
+    int size = snprintf(buffer, sizeof(buffer), spec.c_str(), value);
+    if (size < 0)
+        return;
+
+    if (static_cast<size_t>(size) < sizeof(buffer))
+    {
+        text.append(buffer, size);
+        return;
+    }
+
+    std::vector<char> large(size + 1);
+    snprintf(large.data(), large.size(), spec.c_str(), value);
+    text.append(large.data(), size);
+}
+
+Deferred_Text::Deferred_Text(const char* captured, size_t size):
+format_(captured),
+args_(captured + strlen(captured) + 1),
+args_size_(size - (args_ - captured))
+{
+}
+
+std::string Deferred_Text::format(const char* captured, size_t size)
+{
+    if (!captured || !size)
+        return std::string();
+
+    return Deferred_Text(captured, size).format();
+}
+
+std::string Deferred_Text::format() const
+{
+    std::string text;
+    size_t pos = 0;
+
+    const char* f = format_;
+
+    while (*f)
+    {
+        if (*f != '%')
+        {
+            text.push_back(*f++);
+            continue;
+        }
+
+        if (f[1] == '%')
+        {
+            text.push_back('%');
+            f += 2;
+            continue;
+        }
+
+        std::string spec(1, *f++);
+
+        while (*f && strchr("-+ #0'", *f))
+            spec.push_back(*f++);
+
+        if (*f == '*')
+        {
+            spec += std::to_string(next_int(pos));
+            f++;
+        }
+        else
+            while (isdigit(static_cast<unsigned char>(*f)))
+                spec.push_back(*f++);
+
+        if (*f == '.')
+        {
+            f++;
+
+            if (*f == '*')
+            {
+                long long precision = next_int(pos);
+                if (precision >= 0)
+                    spec += "." + std::to_string(precision);
+                f++;
+            }
+            else
+            {
+                spec.push_back('.');
+                while (isdigit(static_cast<unsigned char>(*f)))
+                    spec.push_back(*f++);
+            }
+        }
+
+        //length modifiers are replaced with the ones matching captured types, only h and hh narrow the value
+        int h_count = 0;
+        while (*f && strchr("hljztLq", *f))
+            if (*f++ == 'h')
+                h_count++;
+
+        if (!*f)
+            break;
+
+        format_arg(text, spec, h_count, *f++, pos);
+    }
+
+    return text;
+}
+
+long long Deferred_Text::next_int(size_t& pos) const
+{
+    if (pos >= args_size_)
+        return 0;
+
+    Arg_Type type = static_cast<Arg_Type>(args_[pos++]);
+    long long value = 0;
+
+    if ((type == int_arg) || (type == unsigned_int_arg) || (type == signed_arg) || (type == unsigned_arg))
+    {
+        memcpy(&value, args_ + pos, sizeof(value));
+        pos += sizeof(value);
+    }
+    else
+        pos = args_size_; //width or precision is not an integer, rest of the arguments is ambiguous
+
+    return value;
+}
+
+void Deferred_Text::format_arg(std::string& text, std::string& spec, int h_count, char conversion, size_t& pos) const
+{
+    if (conversion == 'n')
+    {
+        next_int(pos);
+        return;
+    }
+
+    if (pos >= args_size_)
+        return;
+
+    Arg_Type type = static_cast<Arg_Type>(args_[pos++]);
+    const char* value = args_ + pos;
+
+    long long integer = 0;
+    unsigned long long uinteger = 0;
+    double real = 0;
+    long double long_real = 0;
+    const void* pointer = 0;
+    const char* str = 0;
+
+    switch (type)
+    {
+        case int_arg:
+            memcpy(&integer, value, sizeof(integer));
+            pos += sizeof(integer);
+            uinteger = static_cast<unsigned int>(integer); real = integer; long_real = integer;
+            break;
+
+        case signed_arg:
+            memcpy(&integer, value, sizeof(integer));
+            pos += sizeof(integer);
+            uinteger = integer; real = integer; long_real = integer;
+            break;
+
+        case unsigned_int_arg:
+        case unsigned_arg:
+            memcpy(&uinteger, value, sizeof(uinteger));
+            pos += sizeof(uinteger);
+            integer = uinteger; real = uinteger; long_real = uinteger;
+            break;
+
+        case double_arg:
+            memcpy(&real, value, sizeof(real));
+            pos += sizeof(real);
+            integer = real; uinteger = real; long_real = real;
+            break;
+
+        case long_double_arg:
+            memcpy(&long_real, value, sizeof(long_real));
+            pos += sizeof(long_real);
+            integer = long_real; uinteger = long_real; real = long_real;
+            break;
+
+        case pointer_arg:
+            memcpy(&pointer, value, sizeof(pointer));
+            pos += sizeof(pointer);
+            break;
+
+        case string_arg:
+            str = value;
+            pos += strlen(value) + 1;
+            break;
+
+        case null_string_arg:
+            break;
+
+        default:
+            pos = args_size_;
+            return;
+    }
+
+    if (h_count == 1)
+    {
+        integer = static_cast<short>(integer);
+        uinteger = static_cast<unsigned short>(uinteger);
+    }
+    else if (h_count > 1)
+    {
+        integer = static_cast<signed char>(integer);
+        uinteger = static_cast<unsigned char>(uinteger);
+    }
+
+    switch (conversion)
+    {
+        case 'd': case 'i':
+            append_formatted(text, spec + "ll" + conversion, integer);
+            break;
+
+        case 'u': case 'o': case 'x': case 'X':
+            append_formatted(text, spec + "ll" + conversion, uinteger);
+            break;
+
+        case 'c':
+            append_formatted(text, spec + conversion, static_cast<int>(integer));
+            break;
+
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            if (type == long_double_arg)
+                append_formatted(text, spec + "L" + conversion, long_real);
+            else
+                append_formatted(text, spec + conversion, real);
+            break;
+
+        case 's':
+            append_formatted(text, spec + conversion, str ? str : "(null)");
+            break;
+
+        case 'p':
+            append_formatted(text, spec + conversion, pointer ? pointer : static_cast<const void*>(str));
+            break;
+
+        default:
+            text += spec;
+            text.push_back(conversion);
+            break;
     }
 }
 
+int Message::prio_level(const char* prio)
+{
+    if (!prio)
+        return -1;
+
+    for (int i = Prio_Level::emergency; i <= Prio_Level::debug; ++i)
+        if (strcmp(prio_name(i), prio) == 0)
+            return i;
+
+    return -1;
+}
+
 Message& Message::set_module(std::string& module)
 {
     return set(Optional_Fields::module, module);
@@ -96,11 +477,13 @@ Message& Message::set_line(int line)
 
 Message& Message::set_text(std::string& text)
 {
+    deferred_text_ = nullptr;
     return set(Optional_Fields::text, text);
 }
 
 Message& Message::set_text(const char* text)
 {
+    deferred_text_ = nullptr;
     return set(Optional_Fields::text, text);
 }
 
@@ -124,6 +507,116 @@ Message& Message::set_method(const char* method)
     return set(Optional_Fields::method, method);
 }
 
+Message& Message::set_call_site(const Call_Site& site)
+{
+    if (filtered_out_)
+        return *this;
+
+    set_static(Optional_Fields::module, site.module());
+    set_static(Optional_Fields::line, site.line());
+    set_static(Optional_Fields::method, site.method());
+
+    return *this;
+}
+
+Message& Message::set_call_site(const Call_Site& site, const std::type_info& type)
+{
+    if (filtered_out_)
+        return *this;
+
+    set_call_site(site);
+    set_static(Optional_Fields::class_name, site.class_name(type));
+
+    return *this;
+}
+
+void Message::set_static(const char* param_name, const char* param)
+{
+    rapidjson::Value v(rapidjson::StringRef(param));
+
+    auto it(msg_.FindMember(param_name));
+    if (it == msg_.MemberEnd())
+        msg_.AddMember(rapidjson::StringRef(param_name), v, msg_.GetAllocator());
+    else
+        it->value = v;
+}
+
+void Message::set_static(const char* param_name, int param)
+{
+    rapidjson::Value v(param);
+
+    auto it(msg_.FindMember(param_name));
+    if (it == msg_.MemberEnd())
+        msg_.AddMember(rapidjson::StringRef(param_name), v, msg_.GetAllocator());
+    else
+        it->value = v;
+}
+
+struct Class_Name
+{
+    const std::type_info* type;
+    std::string name;
+};
+
+static std::mutex g_class_names_mutex;
+static std::map<std::type_index, Class_Name> g_class_names; //never shrinks, call sites keep pointers to its elements
+
+static const Class_Name* find_class_name(const std::type_info& type)
+{
+    std::lock_guard<std::mutex> lock(g_class_names_mutex);
+
+    auto it(g_class_names.find(std::type_index(type)));
+    if (it != g_class_names.end())
+        return &it->second;
+
+#ifdef _WIN32_WINNT
+    std::string name(type.name());
+#else
+    std::string name(demangle_cpp_name(type.name()));
+#endif
+
+    size_t space = name.rfind(' ');
+    if (space != std::string::npos)
+        name.erase(0, space + 1);
+
+    Class_Name& class_name(g_class_names[std::type_index(type)]);
+    class_name.type = &type;
+    class_name.name = name;
+
+    return &class_name;
+}
+
+Call_Site::Call_Site(const char* file, int line, const char* function):
+module_(file),
+line_(line),
+method_(function)
+{
+#ifdef _WIN32
+    const char* separator = strrchr(file, '\\');
+#else
+    const char* separator = strrchr(file, '/');
+#endif
+
+    if (separator)
+        module_ = separator + 1;
+
+    separator = strrchr(function, ':');
+    if (separator)
+        method_ = separator + 1;
+}
+
+const char* Call_Site::class_name(const std::type_info& type) const
+{
+    const Class_Name* last = last_class_.load(std::memory_order_acquire);
+    if (last && (last->type == &type))
+        return last->name.c_str();
+
+    last = find_class_name(type);
+    last_class_.store(last, std::memory_order_release);
+
+    return last->name.c_str();
+}
+
 Message& Message::set_sequence(unsigned long long int sequence)
 {
     return set(Optional_Fields::sequence, sequence);
@@ -131,6 +624,9 @@ Message& Message::set_sequence(unsigned long long int sequence)
 
 Message& Message::add(rapidjson::Document& param)
 {
+    if (filtered_out_)
+        return *this;
+
     if (is_valid(param))
     {
         auto it(msg_.FindMember(param.MemberBegin()->name));
@@ -145,6 +641,9 @@ Message& Message::add(rapidjson::Document& param)
 
 Message& Message::add(const std::string& json)
 {
+    if (filtered_out_)
+        return *this;
+
     rapidjson::GenericDocument<rapidjson::UTF8<>> parsed;
     std::unique_ptr<char[]> to_parse(new char[json.size() + 1]);
     parsed.ParseInsitu(to_parse.get());
@@ -154,6 +653,9 @@ Message& Message::add(const std::string& json)
 
 Message& Message::add_batch(rapidjson::Document& batch)
 {
+    if (filtered_out_)
+        return *this;
+
     auto it(batch.MemberBegin());
 
     if ((it == batch.MemberEnd()) || !it->value.IsArray())
@@ -235,12 +737,39 @@ bool Message::is_valid(rapidjson::Document& param)
     return true;
 }
 
+//rapidjson output stream that serializes straight into a std::string.
+struct String_Stream
+{
+    typedef char Ch;
+
+    void Put(char c){ str->push_back(c); }
+    void Flush(){}
+
+    std::string* str = 0;
+};
+
 std::string Message::as_string() const
 {
-    rapidjson::StringBuffer s;
-    rapidjson::Writer<rapidjson::StringBuffer> w(s);
-    msg_.Accept(w);
-    return s.GetString();
+    if (deferred_text_)
+    {
+        Message formatted(*this);
+        formatted.format_deferred();
+        return formatted.as_string();
+    }
+
+    //writer is kept per thread, so that its nesting stack is allocated only once
+    static thread_local String_Stream stream;
+    static thread_local rapidjson::Writer<String_Stream> writer(stream);
+
+    std::string str;
+    str.reserve(512);
+
+    stream.str = &str;
+    writer.Reset(stream);
+    msg_.Accept(writer);
+    stream.str = 0;
+
+    return str;
 }
 
 rapidjson::Document Message::as_json()
@@ -253,28 +782,70 @@ rapidjson::Document Message::as_json()
 Message::Message(const rapidjson::Document& msg)
 {
     msg_.CopyFrom(msg, msg_.GetAllocator());
+    find_prio_level();
 }
 
 Message::Message(const std::string& msg)
 {
     msg_.Parse(msg.c_str());
+    find_prio_level();
 }
 
-Message& Message::add(const char* param_name, std::string& param)
+void Message::find_prio_level()
 {
-    std::string trimmed(param_name);
-    trim(trimmed);
+    std::string_view prio(priority());
+    if (!prio.empty())
+        prio_level_ = prio_level(prio.data());
+}
 
-    rapidjson::GenericValue<rapidjson::UTF8<char>, rapidjson::MemoryPoolAllocator<rapidjson::CrtAllocator>> v(param.c_str(), msg_.GetAllocator());
-    rapidjson::GenericValue<rapidjson::UTF8<char>, rapidjson::MemoryPoolAllocator<rapidjson::CrtAllocator>> name(trimmed.c_str(), msg_.GetAllocator());
+const rapidjson::Value* Message::find(const char* param_name) const
+{
+    if (!param_name || !msg_.IsObject())
+        return nullptr;
 
-    if (param_name && is_valid(trimmed.c_str(), param))
-    {
-        auto it(msg_.FindMember(trimmed.c_str()));
-        if (it == msg_.MemberEnd())
-            msg_.AddMember(name, v, msg_.GetAllocator());
-        else
-            it->value = v;
+    auto it(msg_.FindMember(param_name));
+    if (it == msg_.MemberEnd())
+        return nullptr;
+
+    return &it->value;
+}
+
+std::string_view Message::find_string(const char* param_name) const
+{
+    const rapidjson::Value* value = find(param_name);
+    if (!value || !value->IsString())
+        return std::string_view();
+
+    return std::string_view(value->GetString(), value->GetStringLength());
+}
+
+unsigned long long Message::sequence() const
+{
+    const rapidjson::Value* value = find(Optional_Fields::sequence);
+    if (!value || !value->IsUint64())
+        return 0;
+
+    return value->GetUint64();
+}
+
+Message& Message::add(const char* param_name, std::string& param)
+{
+    if (filtered_out_)
+        return *this;
+
+    std::string trimmed(param_name);
+    trim(trimmed);
+
+    rapidjson::GenericValue<rapidjson::UTF8<char>, rapidjson::MemoryPoolAllocator<rapidjson::CrtAllocator>> v(param.c_str(), msg_.GetAllocator());
+    rapidjson::GenericValue<rapidjson::UTF8<char>, rapidjson::MemoryPoolAllocator<rapidjson::CrtAllocator>> name(trimmed.c_str(), msg_.GetAllocator());
+
+    if (param_name && is_valid(trimmed.c_str(), param))
+    {
+        auto it(msg_.FindMember(trimmed.c_str()));
+        if (it == msg_.MemberEnd())
+            msg_.AddMember(name, v, msg_.GetAllocator());
+        else
+            it->value = v;
     }
 
     return *this;
@@ -282,6 +853,9 @@ Message& Message::add(const char* param_name, std::string& param)
 
 Message& Message::add(const char* param_name, const char* param)
 {
+    if (filtered_out_)
+        return *this;
+
     std::string trimmed(param_name);
     trim(trimmed);
 
@@ -302,84 +876,125 @@ Message& Message::add(const char* param_name, const char* param)
 
 bool Priority_Filter::should_pass(const Message& msg)
 {
-    Message& m = const_cast<Message&>(msg);
-    auto it(m.as_json().FindMember(fplog::Message::Mandatory_Fields::priority));
+    if (msg.prio_level_ >= 0)
+        return (mask_.load(std::memory_order_relaxed) & (1 << msg.prio_level_)) != 0;
 
-    if (it != m.as_json().MemberEnd())
-        return (prio_.find(it->value.GetString()) != prio_.end());
+    std::string_view prio(msg.priority());
+    if (prio.empty())
+        return false;
 
-    return false;
+    //only messages with custom priorities get here, those are rare enough to take the lock
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    return (custom_prio_.find(std::string(prio)) != custom_prio_.end());
 }
 
-void Priority_Filter::construct_numeric()
+void Priority_Filter::clear_custom_prio()
 {
-    prio_numeric_.push_back(Prio::emergency);
-    prio_numeric_.push_back(Prio::alert);
-    prio_numeric_.push_back(Prio::critical);
-    prio_numeric_.push_back(Prio::error);
-    prio_numeric_.push_back(Prio::warning);
-    prio_numeric_.push_back(Prio::notice);
-    prio_numeric_.push_back(Prio::info);
-    prio_numeric_.push_back(Prio::debug);
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    custom_prio_.clear();
 }
 
-void Priority_Filter::add_all_above(const char* prio, bool inclusive)
+void Priority_Filter::set_mask(unsigned char mask)
+{
+    mask_.store(mask, std::memory_order_relaxed);
+    changed();
+}
+
+//Single bits are flipped atomically, so that concurrent add() and remove() of different priorities do not undo each other.
+void Priority_Filter::add(Prio_Level::Type prio)
+{
+    mask_.fetch_or(static_cast<unsigned char>(1 << prio), std::memory_order_relaxed);
+    changed();
+}
+
+void Priority_Filter::remove(Prio_Level::Type prio)
+{
+    mask_.fetch_and(static_cast<unsigned char>(~(1 << prio)), std::memory_order_relaxed);
+    changed();
+}
+
+void Priority_Filter::add(const char* prio)
 {
-    //std::cout << "--> add_all_above(" << prio << ")" << std::endl;
-    std::vector<std::string>::reverse_iterator it(prio_numeric_.rbegin());
-    
-    for (; it != prio_numeric_.rend(); ++it)
+    if (!prio)
+        return;
+
+    int level = Message::prio_level(prio);
+    if (level >= 0)
+        add(static_cast<Prio_Level::Type>(level));
+    else
     {
-        //cout << "it = " << *it << std::endl;
-        if (it->find(std::string(prio)) != std::string::npos)
-            break;
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        custom_prio_.insert(prio);
     }
+}
 
-    if (it == prio_numeric_.rend())
+void Priority_Filter::remove(const char* prio)
+{
+    if (!prio)
     {
-        //std::cout << "prio not found!!!" << std::endl;
+        clear_custom_prio();
+        set_mask(0);
         return;
     }
-    
-    prio_.clear();
 
-    if (inclusive)
-        prio_.insert(prio);
+    int level = Message::prio_level(prio);
+    if (level >= 0)
+        remove(static_cast<Prio_Level::Type>(level));
+    else
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        custom_prio_.erase(prio);
+    }
+}
 
-    ++it;
+int Priority_Filter::find_level(const char* prio, bool least_important_first)
+{
+    if (!prio)
+        return -1;
 
-    for (; it != prio_numeric_.rend(); ++it)
+    for (int i = Prio_Level::emergency; i <= Prio_Level::debug; ++i)
     {
-        prio_.insert(*it);
+        int level = least_important_first ? Prio_Level::debug - i : i;
+        if (strstr(prio_name(level), prio))
+            return level;
     }
+
+    return -1;
 }
 
-void Priority_Filter::add_all_below(const char* prio, bool inclusive)
+void Priority_Filter::add_all_above(const char* prio, bool inclusive)
 {
-    std::vector<std::string>::iterator it(prio_numeric_.begin());
+    int level = find_level(prio, true);
+    if (level < 0)
+        return;
 
-    for (; it != prio_numeric_.end(); ++it)
-        if (it->find(std::string(prio)) != std::string::npos)
-            break;
+    unsigned char mask = static_cast<unsigned char>((1 << level) - 1);
+    if (inclusive)
+        mask |= static_cast<unsigned char>(1 << level);
 
-    if (it == prio_numeric_.end())
-        return;
+    clear_custom_prio();
+    set_mask(mask);
+}
 
-    prio_.clear();
+void Priority_Filter::add_all_below(const char* prio, bool inclusive)
+{
+    int level = find_level(prio, false);
+    if (level < 0)
+        return;
 
+    unsigned char mask = static_cast<unsigned char>(0xFF << (level + 1));
     if (inclusive)
-        prio_.insert(prio);
-
-    ++it;
+        mask |= static_cast<unsigned char>(1 << level);
 
-    for (; it != prio_numeric_.end(); ++it)
-    {
-        prio_.insert(*it);
-    }
+    clear_custom_prio();
+    set_mask(mask);
 }
 
 Message& Message::set_timestamp(const char* timestamp)
 {
+    if (filtered_out_)
+        return *this;
+
     if (timestamp)
         return set(Mandatory_Fields::timestamp, timestamp);
 
@@ -417,7 +1032,7 @@ msg_(prio, Facility::user)
 
 Message& Message::add_binary(const char* param_name, const void* buf, size_t buf_size_bytes)
 {
-    if (!param_name || !buf || !buf_size_bytes)
+    if (filtered_out_ || !param_name || !buf || !buf_size_bytes)
         return *this;
 
     rapidjson::Document d;
@@ -487,10 +1102,239 @@ void Message::one_time_init()
 
 std::vector<std::string> Message::reserved_names_;
 
+static const unsigned short g_level_gate_open = level_gate_has_filters | 0xFF;
+static const unsigned short g_level_gate_no_filters = 0xFF;
+
+#ifndef _WIN32_WINNT
+FPLOG_API thread_local std::atomic<unsigned short> g_level_gate(g_level_gate_open);
+FPLOG_API std::atomic<unsigned short> g_shared_level_gate(g_level_gate_no_filters);
+#else
+static thread_local std::atomic<unsigned short> g_level_gate(g_level_gate_open);
+static std::atomic<unsigned short> g_shared_level_gate(g_level_gate_no_filters);
+
+FPLOG_API bool level_gate_open(int level)
+{
+    unsigned short gate = g_level_gate.load(std::memory_order_relaxed);
+    unsigned short shared = g_shared_level_gate.load(std::memory_order_relaxed);
+
+    return ((gate & shared & (1 << level)) != 0) && (((gate | shared) & level_gate_has_filters) != 0);
+}
+#endif
+
+Message& Message::filtered_out()
+{
+    static thread_local Message dummy(std::string("{}"));
+    dummy.filtered_out_ = true;
+    return dummy;
+}
+
 /************************* fplog client API implementation *************************/
 
 FPLOG_API std::vector<std::string> g_test_results_vector;
 
+//Item of a per-thread ring: either a serialized message or, with deferred formatting,
+//a message whose text is formatted and which is serialized by mq_reader.
+struct Thread_Queue_Entry
+{
+    std::string* str = 0;
+    Message* deferred = 0;
+};
+
+//Queue of a single logging thread when per-thread queues are enabled (thread_queues = true).
+//The logging thread is the only producer of the ring and mq_reader is the only consumer,
+//mq_reader moves everything from the ring to mq so that Queue_Controller drop policies apply per ring.
+struct Thread_Queue
+{
+    Thread_Queue(size_t capacity): ring(capacity) {}
+
+    ~Thread_Queue()
+    {
+        Thread_Queue_Entry entry;
+        while (ring.pop(entry))
+        {
+            delete entry.str;
+            delete entry.deferred;
+        }
+    }
+
+    Spsc_Ring<Thread_Queue_Entry> ring;
+    Queue_Controller mq; //touched only by mq_reader and change_config, both under thread_queues_mutex_
+
+    std::atomic<bool> closed{false}; //set by closelog(), queue is deleted once it is drained
+    std::atomic<unsigned long long> overflow[Queue_Controller::lane_count] = {}; //messages dropped because the ring was full, by lane
+
+    std::atomic<unsigned long long> pushed{0}; //messages pushed into the ring, written only by the owning thread
+    std::atomic<unsigned long long> done{0}; //messages the transport accepted, written only by mq_reader
+
+    //Adds drops of the ring and of mq since the previous call to counts, by lane, and resets them.
+    void collect_drops(unsigned long long (&counts)[Queue_Controller::lane_count])
+    {
+        mq.collect_drops(counts);
+
+        for (int i = 0; i < Queue_Controller::lane_count; ++i)
+            counts[i] += overflow[i].exchange(0, std::memory_order_relaxed);
+    }
+};
+
+//Queue a message was taken from, empty for the shared queue.
+typedef std::shared_ptr<Thread_Queue> Message_Source;
+
+//Message of the string mq_reader sends: the queue it was taken from and its sequence number,
+//which is only read while there are receipts to call (0 otherwise).
+struct Batch_Entry
+{
+    Message_Source source;
+    bool from_ring = false; //taken from the persistent queue, source is empty then
+    unsigned long long sequence = 0;
+};
+
+//Handle on the ring of the calling thread, owner_id tells which Fplog_Impl instance the ring belongs to.
+struct Thread_Queue_Handle
+{
+    unsigned long long owner_id = 0;
+    std::shared_ptr<Thread_Queue> queue;
+};
+
+static thread_local Thread_Queue_Handle g_thread_queue;
+static const size_t g_min_batch_target = 512; //adaptive batch target below that means no waiting at all
+static std::atomic<unsigned long long> g_fplog_impl_counter(0);
+
+//Immutable set of filters of one thread, replaced as a whole on every change.
+struct Filter_Chain
+{
+    Filter_Map filters;
+    unsigned short level_gate = g_level_gate_no_filters; //intersection of filter masks, see level_gate_open()
+
+    Filter_Chain* next_retired = nullptr;
+
+    void update_level_gate()
+    {
+        if (filters.empty())
+        {
+            level_gate = g_level_gate_no_filters;
+            return;
+        }
+
+        unsigned char mask = 0xFF;
+
+        for (auto& filter : filters)
+            mask &= filter.second->level_mask();
+
+        level_gate = level_gate_has_filters | mask;
+    }
+};
+
+//Facility and filters of a single logging thread. Filters are published as Filter_Chain snapshots:
+//the owning thread reads the current one without locks, changes build a new snapshot under the mutex
+//and retire the old one. Only the owning thread reads snapshots while writing, so it frees retired ones
+//once it notices a newer snapshot, by that time it is done with the old ones.
+class Thread_Settings
+{
+    public:
+
+        Thread_Settings() { filters_.store(new Filter_Chain(), std::memory_order_relaxed); }
+        ~Thread_Settings() { delete filters_.load(std::memory_order_relaxed); reclaim(); }
+
+        std::string facility_ = Facility::user;
+
+        std::mutex mutex;
+        std::atomic<unsigned short>* level_gate_ = &g_level_gate; //level gate of the owning thread, nullptr after it exits
+        std::atomic<const Filter_Chain*> shared_hazard_{nullptr}; //shared filters snapshot the owning thread is reading
+
+        //Called only by the owning thread.
+        const Filter_Chain& filters()
+        {
+            const Filter_Chain* chain = filters_.load(std::memory_order_acquire);
+
+            if (chain != reader_chain_)
+            {
+                reclaim();
+                reader_chain_ = chain = filters_.load(std::memory_order_acquire);
+            }
+
+            return *chain;
+        }
+
+        //Changes a copy of the current filters and publishes it, could be called from any thread.
+        void update(std::function<void(Filter_Map&)> change)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            Filter_Chain* chain = new Filter_Chain();
+            chain->filters = filters_.load(std::memory_order_relaxed)->filters;
+
+            if (change)
+                change(chain->filters);
+
+            publish(chain);
+        }
+
+        //Called by the owning thread or when no thread logs anymore, retired snapshots are freed right away.
+        void clear()
+        {
+            Filter_Map filters;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+
+                filters = filters_.load(std::memory_order_relaxed)->filters;
+                publish(new Filter_Chain());
+
+                reclaim();
+                reader_chain_ = nullptr;
+            }
+
+            for (auto& filter : filters)
+                filter.second->set_change_handler(nullptr);
+        }
+
+
+    private:
+
+        std::atomic<Filter_Chain*> filters_;
+        std::atomic<Filter_Chain*> retired_{nullptr};
+        const Filter_Chain* reader_chain_ = nullptr; //last snapshot seen by the owning thread
+
+        //Must be called under the mutex.
+        void publish(Filter_Chain* chain)
+        {
+            chain->update_level_gate();
+
+            Filter_Chain* old = filters_.exchange(chain, std::memory_order_acq_rel);
+
+            old->next_retired = retired_.load(std::memory_order_relaxed);
+            while (!retired_.compare_exchange_weak(old->next_retired, old, std::memory_order_release, std::memory_order_relaxed));
+
+            if (level_gate_)
+                level_gate_->store(chain->level_gate, std::memory_order_relaxed);
+        }
+
+        void reclaim()
+        {
+            Filter_Chain* retired = retired_.exchange(nullptr, std::memory_order_acquire);
+
+            while (retired)
+            {
+                Filter_Chain* next = retired->next_retired;
+                delete retired;
+                retired = next;
+            }
+        }
+};
+
+//Settings of the calling thread, owner_id tells which Fplog_Impl instance they belong to.
+//Settings are released on thread exit, so that filters changed later from other threads
+//do not write into thread local storage that no longer exists.
+struct Thread_Settings_Handle
+{
+    ~Thread_Settings_Handle();
+
+    unsigned long long owner_id = 0;
+    std::shared_ptr<Thread_Settings> settings;
+};
+
+static thread_local Thread_Settings_Handle g_thread_settings;
+
 class FPLOG_API Fplog_Impl
 {
     public:
@@ -503,7 +1347,27 @@ class FPLOG_API Fplog_Impl
         stopping_(false),
         transport_(0),
         mq_reader_(0),
-        async_logging_(true)
+        async_logging_(true),
+        use_thread_queues_(false),
+        thread_queue_capacity_(4096),
+        id_(++g_fplog_impl_counter),
+        next_thread_queue_(0),
+        batch_size_(0),
+        batch_latency_(0),
+        drop_report_interval_(10000),
+        pending_(nullptr),
+        mq_pushed_(0),
+        mq_done_(0),
+        flush_waiters_(0),
+        receipts_count_(0),
+        batch_adaptive_(true),
+        reader_waiting_(false),
+        wakeup_signaled_(false),
+        reader_idle_(false),
+        batch_target_(0),
+        shared_filters_(new Filter_Chain()),
+        persistent_(false),
+        last_drop_report_(std::chrono::steady_clock::now())
         {
             Message::one_time_init();
         }
@@ -515,29 +1379,83 @@ class FPLOG_API Fplog_Impl
 
             std::lock_guard<std::recursive_mutex> lock(mutex_);
 
+            for (auto& settings : thread_settings_)
+                settings->clear();
+
+            update_shared_filters([](Filter_Map& filters)
+            {
+                for (auto& filter : filters)
+                    filter.second->set_change_handler(nullptr);
+
+                filters.clear();
+            });
+
+            delete shared_filters_.load();
+
+            for (auto chain : retired_shared_filters_)
+                delete chain;
+
+            if (g_thread_settings.owner_id == id_)
+            {
+                g_thread_settings.owner_id = 0;
+                g_thread_settings.settings.reset();
+            }
+
             delete mq_reader_;
+            delete pending_.exchange(nullptr);
+
+            //whatever is still queued is dropped, so are receipts of those messages
+            std::map<unsigned long long, Receipt> receipts;
+
+            {
+                std::lock_guard<std::mutex> receipts_lock(receipts_mutex_);
+                receipts.swap(receipts_);
+                receipts_count_ = 0;
+            }
+
+            for (auto& receipt : receipts)
+                receipt.second(receipt.first, false);
 
             if (inited_ && own_transport_)
                 delete transport_;
         }
 
+        //Lock-free, threads that did not call openlog() get the default facility.
         const char* get_facility()
         {
-            std::lock_guard<std::recursive_mutex> lock(mutex_);
-            return thread_log_settings_table_[std::hash<std::thread::id>()(std::this_thread::get_id())].facility_.c_str();
+            if (g_thread_settings.owner_id != id_)
+                return Facility::user;
+
+            return g_thread_settings.settings->facility_.c_str();
         }
 
         void openlog(const char* facility, Filter_Base* filter)
         {
-            std::lock_guard<std::recursive_mutex> lock(mutex_);
-
-            if (facility)
-                thread_log_settings_table_[std::hash<std::thread::id>()(std::this_thread::get_id())].facility_ = facility;
-            else
+            if (!facility)
                 return;
 
+            Thread_Settings& settings(thread_settings());
+            settings.facility_ = facility;
+
             if (filter)
                 add_filter(filter);
+
+            else
+                settings.update(nullptr);
+
+            std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+            if (g_thread_queue.owner_id != id_)
+            {
+                std::shared_ptr<Thread_Queue> queue(std::make_shared<Thread_Queue>(thread_queue_capacity_));
+
+                std::lock_guard<std::recursive_mutex> queues_lock(thread_queues_mutex_);
+                queue->mq.apply_config(mq_config_);
+                thread_queues_.push_back(queue);
+
+                g_thread_queue.owner_id = id_;
+                g_thread_queue.queue = queue;
+            }
         }
 
         void initlog(const char* appname, sprot::Basic_Transport_Interface* transport, bool async_logging)
@@ -561,6 +1479,7 @@ class FPLOG_API Fplog_Impl
             {
                 own_transport_ = false;
                 transport_ = transport;
+                notify_reader();
             }
             else
             {
@@ -572,9 +1491,17 @@ class FPLOG_API Fplog_Impl
         {
             std::lock_guard<std::recursive_mutex> lock(mutex_);
 
-            std::map<unsigned long long int, Logger_Settings>::iterator it = thread_log_settings_table_.find(std::hash<std::thread::id>()(std::this_thread::get_id()));
-            if (it != thread_log_settings_table_.end())
-                thread_log_settings_table_.erase(it);
+            if (g_thread_settings.owner_id == id_)
+                release_thread_settings(id_, g_thread_settings.settings);
+
+            g_thread_settings.owner_id = 0;
+            g_thread_settings.settings.reset();
+
+            if (g_thread_queue.owner_id == id_)
+                g_thread_queue.queue->closed = true;
+
+            g_thread_queue = Thread_Queue_Handle();
+            g_level_gate.store(g_level_gate_open, std::memory_order_relaxed);
         }
 
         static std::string strip_timestamp_and_sequence(std::string input)
@@ -585,13 +1512,73 @@ class FPLOG_API Fplog_Impl
             return input;
         }
 
-        void write(const Message& m)
+        //Lock-free path taken in async mode when per-thread queues are enabled,
+        //returns false if the message has to go through the regular write().
+        //Message is owned by the caller and could be modified or moved from.
+        bool write_to_thread_queue(Message& msg, const Receipt& receipt)
         {
-            Message msg(m);
+            if (!use_thread_queues_ || !async_logging_ || test_mode_ || stopping_ || persistent_)
+                return false;
+
+            if (g_thread_queue.owner_id != id_)
+                return false;
+
+            msg.set(Message::Mandatory_Fields::appname, appname_);
+
+            if (!passed_filters(msg))
+            {
+                if (receipt)
+                    receipt(0, false);
+
+                return true;
+            }
+
+            unsigned long long sequence = sequence_number::read_sequence_number();
+            msg.set_sequence(sequence);
+
+            if (receipt)
+                expect_receipt(sequence, receipt);
+
+            int lane = (msg.prio_level_ >= 0) ? msg.prio_level_ : Queue_Controller::unknown_lane;
+
+            Thread_Queue_Entry entry;
+            if (msg.deferred_text_)
+                entry.deferred = new Message(std::move(msg));
+            else
+                entry.str = new std::string(msg.as_string());
+
+            Thread_Queue& queue(*g_thread_queue.queue);
+
+            if (!queue.ring.push(entry))
+            {
+                queue.overflow[lane].fetch_add(1, std::memory_order_relaxed);
+                delete entry.str;
+                delete entry.deferred;
+
+                if (receipt)
+                    confirm(sequence, false);
+            }
+            else
+            {
+                queue.pushed.store(queue.pushed.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+                notify_reader();
+            }
+
+            return true;
+        }
 
+        //Message is owned by the caller and could be modified.
+        //Returns true if the outcome is known right away (sync or test mode, filtered out, shut down), then the caller calls
+        //the receipt with sequence and delivered once it released its locks, so that receipts never run under mutex_.
+        bool write(Message& msg, const Receipt& receipt, unsigned long long& sequence, bool& delivered)
+        {
             std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+            sequence = 0;
+            delivered = false;
+
             if (stopping_)
-                return;
+                return true;
 
             msg.set(Message::Mandatory_Fields::appname, appname_);
             //std::cout << "logging message: " << msg.as_string() << std::endl;
@@ -599,19 +1586,40 @@ class FPLOG_API Fplog_Impl
             if (passed_filters(msg))
             {
                 //std::cout << "message passed filters OK" << std::endl;
-                msg.set_sequence(sequence_number::read_sequence_number());
+                msg.format_deferred();
+
+                sequence = sequence_number::read_sequence_number();
+                msg.set_sequence(sequence);
 
                 if (test_mode_)
+                {
                     g_test_results_vector.push_back(strip_timestamp_and_sequence(msg.as_string()));
+
+                    delivered = true;
+                    return true;
+                }
                 else
                 {
                     if (async_logging_)
                     {
                         //std::cout << "message got inside the queue" << std::endl;
-                        mq_.push(new std::string(msg.as_string()));
+                        if (receipt)
+                            expect_receipt(sequence, receipt);
+
+                        //messages that do not fit into the file are kept in memory, but they would not survive a crash
+                        std::string str(msg.as_string());
+                        if (!ring_ || !ring_->push(str.c_str(), str.size()))
+                            mq_.push(str.c_str(), str.size(), msg.prio_level_);
+
+                        mq_pushed_++;
+                        notify_reader();
+
+                        return false;
                     }
                     else
                     {
+                        bool sent = false;
+
                         int send_retries = 12;
                         while (send_retries > 0)
                         {
@@ -620,6 +1628,7 @@ class FPLOG_API Fplog_Impl
                                 //std::cout << "preparing to write message directly" << std::endl;
                                 std::string str(msg.as_string());
                                 transport_->write(str.c_str(), str.size(), 400);
+                                sent = true;
                                 break;
                             }
                             catch(fplog::exceptions::Generic_Exception& e)
@@ -629,46 +1638,202 @@ class FPLOG_API Fplog_Impl
                                 std::this_thread::sleep_for(std::chrono::milliseconds(10));
                             }
                         }
+
+                        delivered = sent;
+                        return true;
                     }
                 }
             }
+
+            return true;
         }
 
-        void add_filter(Filter_Base* filter)
+        //Stops mq_reader and wakes up flush() callers, everything still queued is dropped on destruction.
+        void stop()
         {
-            if (!filter)
-                return;
-
-            std::string filter_id(filter->get_id());
-            generic_util::trim(filter_id);
-            if (filter_id.empty())
-                return;
-
-            std::lock_guard<std::recursive_mutex> lock(mutex_);
-            Logger_Settings settings = Logger_Settings(thread_log_settings_table_[std::hash<std::thread::id>()(std::this_thread::get_id())]);
-            settings.filter_id_ptr_map[filter_id] = std::shared_ptr<Filter_Base>(filter);
-
-            thread_log_settings_table_[std::hash<std::thread::id>()(std::this_thread::get_id())] = settings;
+            stop_reading_queue();
         }
 
-        void remove_filter(Filter_Base* filter)
+        //Blocks until the transport accepted every message queued before the call, false on timeout or shutdown.
+        //Messages dropped by queue overflow handling are only accounted for once mq_reader runs out of work.
+        bool flush(size_t timeout)
         {
-            if (!filter)
-                return;
+            if (!async_logging_ || test_mode_)
+                return true;
 
-            std::lock_guard<std::recursive_mutex> lock(mutex_);
+            unsigned long long mq_target = 0;
+            std::vector<std::pair<Message_Source, unsigned long long>> targets;
 
-            Logger_Settings settings(thread_log_settings_table_[std::hash<std::thread::id>()(std::this_thread::get_id())]);
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                mq_target = mq_pushed_;
+            }
 
-            std::string filter_id(filter->get_id());
-            if (!filter_id.empty())
             {
-                settings.filter_id_ptr_map.erase(settings.filter_id_ptr_map.find(filter_id));
-                thread_log_settings_table_[std::hash<std::thread::id>()(std::this_thread::get_id())] = settings;
+                std::lock_guard<std::recursive_mutex> lock(thread_queues_mutex_);
+                for (auto& queue : thread_queues_)
+                    targets.push_back(std::make_pair(queue, queue->pushed.load(std::memory_order_acquire)));
             }
+
+            auto flushed = [&]()
+            {
+                if (stopping_)
+                    return true;
+
+                //wakeup_signaled_ is set when something got queued while mq_reader is idle
+                if (reader_idle_ && !wakeup_signaled_)
+                    return true;
+
+                if (mq_done_.load(std::memory_order_acquire) < mq_target)
+                    return false;
+
+                for (auto& target : targets)
+                    if (target.first->done.load(std::memory_order_acquire) < target.second)
+                        return false;
+
+                return true;
+            };
+
+            flush_waiters_++;
+
+            bool res = false;
+
+            {
+                std::unique_lock<std::mutex> lock(wakeup_mutex_);
+
+                if (timeout == sprot::Basic_Transport_Interface::infinite_wait)
+                {
+                    reader_progress_.wait(lock, flushed);
+                    res = true;
+                }
+                else
+                    res = reader_progress_.wait_for(lock, std::chrono::milliseconds(timeout), flushed);
+            }
+
+            flush_waiters_--;
+
+            return res && !stopping_;
+        }
+
+        void add_filter(Filter_Base* filter)
+        {
+            if (!filter)
+                return;
+
+            std::string filter_id(filter->get_id());
+            generic_util::trim(filter_id);
+            if (filter_id.empty())
+                return;
+
+            std::shared_ptr<Thread_Settings> settings(thread_settings_ptr());
+            std::shared_ptr<Filter_Base> added(filter);
+
+            std::weak_ptr<Thread_Settings> owner(settings);
+            filter->set_change_handler([owner](){ if (auto settings = owner.lock()) settings->update(nullptr); });
+
+            settings->update([&](Filter_Map& filters){ filters[filter_id] = added; });
+        }
+
+        void remove_filter(Filter_Base* filter)
+        {
+            if (!filter)
+                return;
+
+            std::string filter_id(filter->get_id());
+            if (filter_id.empty())
+                return;
+
+            Thread_Settings& settings(thread_settings());
+            std::shared_ptr<Filter_Base> removed;
+
+            settings.update([&](Filter_Map& filters)
+            {
+                Filter_Map::iterator found(filters.find(filter_id));
+                if (found == filters.end())
+                    return;
+
+                removed = found->second;
+                filters.erase(found);
+            });
+
+            if (removed)
+                removed->set_change_handler(nullptr);
+        }
+
+        //Called from the exiting thread, see Thread_Settings_Handle.
+        void release_thread_settings(unsigned long long owner_id, const std::shared_ptr<Thread_Settings>& settings)
+        {
+            if (owner_id != id_)
+                return;
+
+            std::lock_guard<std::recursive_mutex> lock(mutex_);
+            thread_settings_.erase(std::remove(thread_settings_.begin(), thread_settings_.end(), settings), thread_settings_.end());
+            settings->clear();
         }
 
         Filter_Base* find_filter(const char* filter_id)
+        {
+            if (!filter_id)
+                return 0;
+
+            std::string filter_id_trimmed(filter_id);
+            generic_util::trim(filter_id_trimmed);
+            if (filter_id_trimmed.empty())
+                return 0;
+
+            if (g_thread_settings.owner_id != id_)
+                return 0;
+
+            const Filter_Map& filters(g_thread_settings.settings->filters().filters);
+            Filter_Map::const_iterator found(filters.find(filter_id_trimmed));
+            if (found != filters.end())
+                return found->second.get();
+
+            return 0;
+        }
+
+        void add_shared_filter(Filter_Base* filter)
+        {
+            if (!filter)
+                return;
+
+            std::string filter_id(filter->get_id());
+            generic_util::trim(filter_id);
+            if (filter_id.empty())
+                return;
+
+            std::shared_ptr<Filter_Base> added(filter);
+            filter->set_change_handler([this](){ update_shared_filters(nullptr); });
+
+            update_shared_filters([&](Filter_Map& filters){ filters[filter_id] = added; });
+        }
+
+        void remove_shared_filter(Filter_Base* filter)
+        {
+            if (!filter)
+                return;
+
+            std::string filter_id(filter->get_id());
+            if (filter_id.empty())
+                return;
+
+            std::shared_ptr<Filter_Base> removed;
+
+            update_shared_filters([&](Filter_Map& filters)
+            {
+                Filter_Map::iterator found(filters.find(filter_id));
+                if (found == filters.end())
+                    return;
+
+                removed = found->second;
+                filters.erase(found);
+            });
+
+            if (removed)
+                removed->set_change_handler(nullptr);
+        }
+
+        Filter_Base* find_shared_filter(const char* filter_id)
         {
             if (!filter_id)
                 return 0;
@@ -680,9 +1845,9 @@ class FPLOG_API Fplog_Impl
 
             std::lock_guard<std::recursive_mutex> lock(mutex_);
 
-            Logger_Settings settings(thread_log_settings_table_[std::hash<std::thread::id>()(std::this_thread::get_id())]);
-            std::map<std::string, std::shared_ptr<Filter_Base>>::iterator found(settings.filter_id_ptr_map.find(filter_id_trimmed));
-            if (found != settings.filter_id_ptr_map.end())
+            const Filter_Map& filters(shared_filters_.load(std::memory_order_relaxed)->filters);
+            Filter_Map::const_iterator found(filters.find(filter_id_trimmed));
+            if (found != filters.end())
                 return found->second.get();
 
             return 0;
@@ -693,6 +1858,7 @@ class FPLOG_API Fplog_Impl
         void change_config(const sprot::Params& config);
 
 
+
     private:
 
         //Shared_Sequence_Number sequence_;
@@ -708,25 +1874,169 @@ class FPLOG_API Fplog_Impl
         Queue_Controller mq_;
         std::thread* mq_reader_;
 
-        struct Logger_Settings
-        {
-            Logger_Settings() : facility_(Facility::user) {}
-            Filter_Map filter_id_ptr_map;
-            std::string facility_;
-        };
+        std::vector<std::shared_ptr<Thread_Settings>> thread_settings_; //settings of all threads that opened the log or wrote to it
 
-        std::map<unsigned long long int, Logger_Settings> thread_log_settings_table_;
+        //Shared filters are read by all threads at once, so a retired snapshot is freed only after
+        //no thread announces it in Thread_Settings::shared_hazard_.
+        std::atomic<Filter_Chain*> shared_filters_;
+        std::vector<Filter_Chain*> retired_shared_filters_;
 
         std::recursive_mutex mutex_;
         std::recursive_mutex mq_reader_mutex_;
 
         sprot::Basic_Transport_Interface* transport_;
 
+        volatile bool use_thread_queues_;
+        size_t thread_queue_capacity_;
+        unsigned long long id_;
+
+        std::vector<std::shared_ptr<Thread_Queue>> thread_queues_;
+        size_t next_thread_queue_;
+        sprot::Params mq_config_; //last config applied to mq_, new thread queues start with it
+        std::recursive_mutex thread_queues_mutex_;
+
+        volatile size_t batch_size_; //max size of a batch frame in bytes, 0 sends every message in its own frame
+        volatile size_t batch_latency_; //how long in ms the first message of a batch could wait for others
+        std::atomic<std::string*> pending_; //message that did not fit into the previous batch
+        Batch_Entry pending_entry_; //where pending_ was taken from, used by mq_reader only
+
+        unsigned long long mq_pushed_; //messages pushed into mq_, guarded by mutex_
+        std::atomic<unsigned long long> mq_done_; //messages from mq_ the transport accepted
+        std::atomic<unsigned int> flush_waiters_;
+
+        std::mutex receipts_mutex_;
+        std::map<unsigned long long, Receipt> receipts_; //receipts of queued messages by sequence number
+        std::atomic<size_t> receipts_count_;
+        volatile bool batch_adaptive_; //batch target follows queue depth instead of always waiting for a full batch
+
+        //mq_reader sleeps on wakeup_ when queues are empty, producers signal it only if reader_waiting_ is set.
+        std::mutex wakeup_mutex_;
+        std::condition_variable wakeup_;
+        std::condition_variable reader_progress_;
+        std::atomic<bool> reader_waiting_;
+        bool wakeup_signaled_; //guarded by wakeup_mutex_
+        bool reader_idle_; //guarded by wakeup_mutex_, set while mq_reader sleeps with nothing left to send
+        size_t batch_target_; //current adaptive batch target in bytes, used by mq_reader only
+
+        std::unique_ptr<Persistent_Ring> ring_; //file backed queue used instead of mq_ when set, guarded by mutex_
+        std::atomic<bool> persistent_; //ring_ is set
+
+        volatile size_t drop_report_interval_; //min ms between reports about messages the queues dropped, 0 turns reports off
+        std::chrono::steady_clock::time_point last_drop_report_; //used by mq_reader only
+        unsigned long long retired_drops_[Queue_Controller::lane_count] = {}; //drops of removed thread queues, guarded by thread_queues_mutex_
+
         void stop_reading_queue()
         {
             stopping_ = true;
+
+            {
+                std::lock_guard<std::mutex> lock(wakeup_mutex_);
+                wakeup_signaled_ = true;
+            }
+
+            wakeup_.notify_all();
+            reader_progress_.notify_all();
+
             std::lock_guard<std::recursive_mutex> lock(mq_reader_mutex_);
         }
+
+        //Called by producers after queuing a message, cheap unless mq_reader is about to sleep or sleeping.
+        void notify_reader()
+        {
+            //pairs with the fence in wait_for_messages(): either the reader sees the new message or we see it waiting
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if (!reader_waiting_.load(std::memory_order_relaxed))
+                return;
+
+            {
+                std::lock_guard<std::mutex> lock(wakeup_mutex_);
+                wakeup_signaled_ = true;
+            }
+
+            wakeup_.notify_one();
+        }
+
+        //Puts mq_reader to sleep until producers queue something, the log is stopping or the deadline passes.
+        //Idle means there is no batch in progress, wait_until_queues_are_empty() is waiting for that.
+        void wait_for_messages(bool idle, std::chrono::steady_clock::time_point deadline)
+        {
+            reader_waiting_.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if (stopping_ || have_messages())
+            {
+                reader_waiting_.store(false, std::memory_order_relaxed);
+                return;
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(wakeup_mutex_);
+
+                if (idle)
+                {
+                    reader_idle_ = true;
+                    reader_progress_.notify_all();
+                }
+
+                auto signaled = [this](){ return wakeup_signaled_ || stopping_; };
+
+                if (deadline == std::chrono::steady_clock::time_point::max())
+                    wakeup_.wait(lock, signaled);
+                else
+                    wakeup_.wait_until(lock, deadline, signaled);
+
+                wakeup_signaled_ = false;
+                reader_idle_ = false;
+            }
+
+            reader_waiting_.store(false, std::memory_order_relaxed);
+        }
+
+        bool have_messages()
+        {
+            if (!transport_)
+                return false;
+
+            if (pending_.load())
+                return true;
+
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                if (!mq_.empty() || (ring_ && ring_->has_unread()))
+                    return true;
+            }
+
+            return !thread_queues_empty();
+        }
+
+        void expect_receipt(unsigned long long sequence, const Receipt& receipt)
+        {
+            std::lock_guard<std::mutex> lock(receipts_mutex_);
+
+            receipts_[sequence] = receipt;
+            receipts_count_ = receipts_.size();
+        }
+
+        //Calls the receipt of the given message if there is one, receipts are called without holding any locks.
+        void confirm(unsigned long long sequence, bool delivered)
+        {
+            Receipt receipt;
+
+            {
+                std::lock_guard<std::mutex> lock(receipts_mutex_);
+
+                auto found(receipts_.find(sequence));
+                if (found == receipts_.end())
+                    return;
+
+                receipt.swap(found->second);
+                receipts_.erase(found);
+                receipts_count_ = receipts_.size();
+            }
+
+            receipt(sequence, delivered);
+        }
         
         void mq_reader()
         {
@@ -734,18 +2044,16 @@ class FPLOG_API Fplog_Impl
 
             while(!stopping_)
             {
-                
-                std::string* str = 0;
+                report_drops();
 
-                {
-                    std::lock_guard<std::recursive_mutex> lock(mutex_);
-                
-                    if (!mq_.empty() && transport_)
-                    {
-                        str = mq_.front();
-                        mq_.pop();
-                    }
-                }
+                std::vector<Batch_Entry> entries(1);
+                std::string* str = read_queues(entries.back());
+
+                if (str)
+                    read_sequences(str->data(), str->data() + str->size(), &entries.back(), 1);
+
+                if (str && batch_size_)
+                    str = make_batch(str, entries);
 
                 std::unique_ptr<std::string> str_ptr(str);
 
@@ -757,13 +2065,12 @@ class FPLOG_API Fplog_Impl
                 try
                 {
                     if (str)
-                        transport_->write(str->c_str(), str->size(), 400);
-                    else
                     {
-                        if (stopping_)
-                            return;
-                        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                        transport_->write(str->c_str(), str->size(), 400);
+                        delivered(entries);
                     }
+                    else
+                        wait_for_messages(true, next_drop_report());
 
                 }
                 catch(fplog::exceptions::Generic_Exception)
@@ -774,44 +2081,602 @@ class FPLOG_API Fplog_Impl
             }
         }
 
-        bool passed_filters(const Message& msg)
+        //Queues a warning from Facility::fplog that tells how many messages of each priority the queues dropped since
+        //the previous report, e.g. "dropped 120 debug / 3 info in last 10000 ms". Counts are taken once drop_report_interval_
+        //has passed, so a reader that keeps going idle does not report each burst separately.
+        void report_drops()
         {
+            static const char* names[Queue_Controller::lane_count] = {Prio::emergency, Prio::alert, Prio::critical, Prio::error,
+                                                                      Prio::warning, Prio::notice, Prio::info, Prio::debug, "other"};
+
+            size_t interval = drop_report_interval_;
+            auto now = std::chrono::steady_clock::now();
+
+            if (!interval || (now - last_drop_report_ < std::chrono::milliseconds(interval)))
+                return;
+
+            unsigned long long counts[Queue_Controller::lane_count] = {};
+
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                mq_.collect_drops(counts);
+            }
+
+            {
+                std::lock_guard<std::recursive_mutex> lock(thread_queues_mutex_);
+                for (auto& queue : thread_queues_)
+                    queue->collect_drops(counts);
+
+                for (int i = 0; i < Queue_Controller::lane_count; ++i)
+                    counts[i] += retired_drops_[i];
+
+                std::fill(std::begin(retired_drops_), std::end(retired_drops_), 0ULL);
+            }
+
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_drop_report_).count();
+            bool found = false;
+
+            Message msg(Prio::warning, Facility::fplog);
+            std::string text("dropped ");
+
+            for (int i = 0; i < Queue_Controller::lane_count; ++i)
+            {
+                if (!counts[i])
+                    continue;
+
+                if (found)
+                    text += " / ";
+
+                text += std::to_string(counts[i]) + " " + names[i];
+                msg.add((std::string("dropped_") + names[i]).c_str(), static_cast<long long>(counts[i]));
+                found = true;
+            }
+
+            last_drop_report_ = now;
+
+            if (!found)
+                return;
+
+            text += " in last " + std::to_string(elapsed) + " ms";
+            msg.set_text(text);
+            msg.set_sequence(sequence_number::read_sequence_number());
+
             std::lock_guard<std::recursive_mutex> lock(mutex_);
-            Logger_Settings settings(thread_log_settings_table_[std::hash<std::thread::id>()(std::this_thread::get_id())]);
-            
-            //std::cout << "--> passed_filters" << std::endl;
-            
-            if (settings.filter_id_ptr_map.size() == 0)
+
+            msg.set(Message::Mandatory_Fields::appname, appname_);
+            std::string str(msg.as_string());
+
+            mq_.push(str.c_str(), str.size(), Prio_Level::warning);
+            mq_pushed_++;
+        }
+
+        //Time when an idle mq_reader has to wake up to check for drops to report.
+        std::chrono::steady_clock::time_point next_drop_report()
+        {
+            size_t interval = drop_report_interval_;
+
+            if (!interval)
+                return std::chrono::steady_clock::time_point::max();
+
+            return last_drop_report_ + std::chrono::milliseconds(interval);
+        }
+
+        //Next message to send: the one left over from the previous batch, then the persistent queue, then the shared queue,
+        //then per-thread queues. Entry tells which queue the message came from, its sequence is left as it is.
+        std::string* read_queues(Batch_Entry& entry)
+        {
+            std::string* str = pending_.exchange(nullptr);
+            if (str)
             {
-                //std::cout << "FALSE <-- passed_filters (no filters in map)" << std::endl;
-                return false;
+                entry.source.swap(pending_entry_.source);
+                entry.from_ring = pending_entry_.from_ring;
+                pending_entry_ = Batch_Entry();
+                return str;
+            }
+
+            entry.source.reset();
+            entry.from_ring = false;
+
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+                std::string record;
+                if (ring_ && transport_ && ring_->read(record))
+                {
+                    entry.from_ring = true;
+                    return new std::string(std::move(record));
+                }
+
+                if (!mq_.empty() && transport_)
+                {
+                    str = mq_.front();
+                    mq_.pop();
+                }
+            }
+
+            if (!str && transport_)
+                str = read_thread_queues(entry.source);
+
+            return str;
+        }
+
+        //Called by mq_reader once the transport accepted the string that carries the given messages.
+        void delivered(const std::vector<Batch_Entry>& entries)
+        {
+            size_t from_ring = 0;
+
+            for (auto& entry : entries)
+            {
+                if (entry.from_ring)
+                {
+                    from_ring++;
+                    mq_done_++;
+                }
+                else if (entry.source)
+                    entry.source->done++;
+                else
+                    mq_done_++;
+            }
+
+            if (from_ring)
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                ring_->commit(from_ring);
+            }
+
+            for (auto& entry : entries)
+                if (entry.sequence)
+                    confirm(entry.sequence, true);
+
+            if (flush_waiters_)
+            {
+                { std::lock_guard<std::mutex> lock(wakeup_mutex_); }
+                reader_progress_.notify_all();
+            }
+        }
+
+        //Coalesces queued messages following the first one into a single message with batch array,
+        //so that they share one protocol frame. Messages already queued are taken right away up to batch_size_,
+        //the reader waits for more only while the batch is below its target size and not longer than batch_latency_
+        //since the first message. Adaptive target grows while messages keep piling up in the queue and shrinks
+        //each time the latency deadline passes, so that at low rates messages are sent without waiting.
+        //Messages of error and higher priorities are sent right away.
+        std::string* make_batch(std::string* first, std::vector<Batch_Entry>& entries)
+        {
+            size_t batch_size = batch_size_;
+            if (first->size() >= batch_size)
+                return first;
+
+            size_t target = batch_adaptive_ ? std::min(batch_target_, batch_size) : batch_size;
+            bool flush_now = urgent(*first);
+
+            std::unique_ptr<std::string> first_ptr(first);
+            std::string batch(batch_header());
+            batch += *first;
+
+            size_t count = 1;
+            bool waited = false, deadline_passed = false;
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(batch_latency_);
+
+            while (!stopping_)
+            {
+                if (!pending_.load() && transport_ && !persistent_)
+                {
+                    //messages of the shared queue are copied right from its storage into the batch
+                    Queue_Controller::Read_Result res;
+                    size_t read_from = batch.size();
+
+                    {
+                        std::lock_guard<std::recursive_mutex> lock(mutex_);
+                        res = mq_.read(batch, batch_size - 2, ',', Prio_Level::error);
+                    }
+
+                    if (res.count)
+                    {
+                        entries.resize(entries.size() + res.count);
+                        read_sequences(batch.data() + read_from, batch.data() + batch.size(), &entries[entries.size() - res.count], res.count);
+                        count += res.count;
+
+                        if (res.flush)
+                            break;
+
+                        continue;
+                    }
+                }
+
+                Batch_Entry entry;
+                std::string* str = read_queues(entry);
+
+                if (!str)
+                {
+                    if (flush_now || (batch.size() >= target))
+                        break;
+
+                    if (std::chrono::steady_clock::now() >= deadline)
+                    {
+                        deadline_passed = true;
+                        break;
+                    }
+
+                    waited = true;
+                    wait_for_messages(false, deadline);
+                    continue;
+                }
+
+                if (batch.size() + str->size() + 3 > batch_size)
+                {
+                    pending_entry_ = entry;
+                    pending_ = str;
+                    break;
+                }
+
+                batch += ',';
+                batch += *str;
+                count++;
+
+                entries.push_back(entry);
+                read_sequences(str->data(), str->data() + str->size(), &entries.back(), 1);
+
+                bool urgent_str = urgent(*str);
+                delete str;
+
+                if (urgent_str)
+                    break;
+            }
+
+            if (deadline_passed)
+                batch_target_ = (batch_target_ / 2 < g_min_batch_target) ? 0 : batch_target_ / 2;
+            else if (!waited && (count > 1))
+                batch_target_ = std::min(std::max(batch_target_ * 2, g_min_batch_target), batch_size);
+
+            if (count == 1)
+                return first_ptr.release();
+
+            batch += "]}";
+            return new std::string(std::move(batch));
+        }
+
+        //Sets sequence numbers of up to count entries from the serialized messages in [begin, end), separated by commas.
+        //Only top-level members of each message are looked at, so that "sequence" in user fields or text is never taken for one.
+        //Does nothing while no receipts are expected, receipts are registered before their messages are queued.
+        void read_sequences(const char* begin, const char* end, Batch_Entry* entries, size_t count)
+        {
+            if (!receipts_count_.load(std::memory_order_acquire))
+                return;
+
+            static const size_t key_size = strlen(Message::Optional_Fields::sequence);
+
+            size_t index = 0;
+            int depth = 0;
+            bool member_name = false;
+
+            for (const char* p = begin; p < end; ++p)
+            {
+                switch (*p)
+                {
+                    case '"':
+                    {
+                        const char* name = ++p;
+                        while ((p < end) && (*p != '"'))
+                            p += (*p == '\\') ? 2 : 1;
+
+                        if (member_name && (index <= count) && (static_cast<size_t>(p - name) == key_size)
+                            && (memcmp(name, Message::Optional_Fields::sequence, key_size) == 0))
+                        {
+                            const char* value = p + 1;
+                            while ((value < end) && ((*value == ':') || isspace(static_cast<unsigned char>(*value))))
+                                value++;
+
+                            if (value < end)
+                                entries[index - 1].sequence = strtoull(value, 0, 10);
+                        }
+
+                        member_name = false;
+                        break;
+                    }
+
+                    case '{':
+                    case '[':
+                        if ((depth == 0) && (index++ == count))
+                            return;
+
+                        depth++;
+                        member_name = (depth == 1);
+                        break;
+
+                    case '}':
+                    case ']':
+                        depth--;
+                        break;
+
+                    case ',':
+                        member_name = (depth == 1);
+                        break;
+                }
+            }
+        }
+
+        //Messages of error and higher priorities are never held back to fill up a batch.
+        static bool urgent(const std::string& str)
+        {
+            return Queue_Controller::lane(str) <= Prio_Level::error;
+        }
+
+        //Batch message up to the opening bracket of its batch array, see Message::add_batch().
+        std::string batch_header()
+        {
+            Message header(Prio::info, Facility::fplog);
+
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                header.set(Message::Mandatory_Fields::appname, appname_);
             }
 
-            bool should_pass = true;
+            std::string str(header.as_string());
+            str.pop_back();
+
+            str += ",\"";
+            str += Message::Optional_Fields::batch;
+            str += "\":[";
+
+            return str;
+        }
+
+        //Moves everything producers pushed into their rings to the per-ring queue controllers
+        //and takes the next message from them in round-robin order, nullptr if all are empty.
+        std::string* read_thread_queues(Message_Source& source)
+        {
+            std::lock_guard<std::recursive_mutex> lock(thread_queues_mutex_);
+
+            Thread_Queue_Entry entry;
+
+            for (auto& queue : thread_queues_)
+                while (queue->ring.pop(entry))
+                    queue->mq.push(serialize(entry));
+
+            std::string* str = 0;
 
-            for (std::map<std::string, std::shared_ptr<Filter_Base>>::iterator it = settings.filter_id_ptr_map.begin(); it != settings.filter_id_ptr_map.end(); ++it)
+            for (size_t i = 0; i < thread_queues_.size(); ++i)
             {
-                should_pass = (should_pass && it->second->should_pass(msg));
-                if (!should_pass)
+                size_t index = (next_thread_queue_ + i) % thread_queues_.size();
+                std::shared_ptr<Thread_Queue>& queue(thread_queues_[index]);
+
+                if (!queue->mq.empty())
+                {
+                    str = queue->mq.front();
+                    queue->mq.pop();
+                    source = queue;
+                    next_thread_queue_ = index + 1;
                     break;
+                }
             }
 
-            //std::cout << should_pass << " <-- passed_filters" << std::endl;
+            auto drained = [this](const std::shared_ptr<Thread_Queue>& queue)
+            {
+                if (!(queue->closed && queue->ring.empty() && queue->mq.empty()))
+                    return false;
+
+                queue->collect_drops(retired_drops_);
+                return true;
+            };
+
+            thread_queues_.erase(std::remove_if(thread_queues_.begin(), thread_queues_.end(), drained), thread_queues_.end());
+
+            return str;
+        }
+
+        //Formats text of a deferred message on the mq_reader thread, entry gives up ownership of its data.
+        static std::string* serialize(Thread_Queue_Entry& entry)
+        {
+            if (!entry.deferred)
+                return entry.str;
+
+            std::unique_ptr<Message> msg(entry.deferred);
+            msg->format_deferred();
+
+            return new std::string(msg->as_string());
+        }
+
+        bool thread_queues_empty()
+        {
+            std::lock_guard<std::recursive_mutex> lock(thread_queues_mutex_);
+
+            for (auto& queue : thread_queues_)
+                if (!queue->ring.empty() || !queue->mq.empty())
+                    return false;
+
+            return true;
+        }
+
+        //Settings of the calling thread, registered on first use and dropped by closelog().
+        std::shared_ptr<Thread_Settings> thread_settings_ptr()
+        {
+            if (g_thread_settings.owner_id != id_)
+            {
+                std::shared_ptr<Thread_Settings> settings(std::make_shared<Thread_Settings>());
+
+                {
+                    std::lock_guard<std::recursive_mutex> lock(mutex_);
+                    thread_settings_.push_back(settings);
+                }
+
+                g_thread_settings.owner_id = id_;
+                g_thread_settings.settings = settings;
+            }
+
+            return g_thread_settings.settings;
+        }
+
+        Thread_Settings& thread_settings()
+        {
+            return *thread_settings_ptr();
+        }
+
+        //Changes a copy of shared filters and publishes it, retired snapshots nobody reads anymore are freed.
+        void update_shared_filters(std::function<void(Filter_Map&)> change)
+        {
+            std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+            Filter_Chain* chain = new Filter_Chain();
+            chain->filters = shared_filters_.load(std::memory_order_relaxed)->filters;
+
+            if (change)
+                change(chain->filters);
+
+            chain->update_level_gate();
+
+            retired_shared_filters_.push_back(shared_filters_.exchange(chain, std::memory_order_seq_cst));
+            g_shared_level_gate.store(chain->level_gate, std::memory_order_relaxed);
+
+            std::vector<Filter_Chain*> in_use;
+            for (auto& settings : thread_settings_)
+                in_use.push_back(const_cast<Filter_Chain*>(settings->shared_hazard_.load(std::memory_order_seq_cst)));
+
+            auto still_retired = std::partition(retired_shared_filters_.begin(), retired_shared_filters_.end(),
+                                                [&](Filter_Chain* retired){ return std::find(in_use.begin(), in_use.end(), retired) != in_use.end(); });
+
+            for (auto it = still_retired; it != retired_shared_filters_.end(); ++it)
+                delete *it;
+
+            retired_shared_filters_.erase(still_retired, retired_shared_filters_.end());
+        }
+
+        //Lock-free, shared filters are checked first and then the current filters snapshot of the calling thread.
+        bool passed_filters(const Message& msg)
+        {
+            Thread_Settings& settings(thread_settings());
+
+            //announce the snapshot before reading it and make sure it was not retired in the meantime
+            const Filter_Chain* shared = shared_filters_.load(std::memory_order_acquire);
+            for (;;)
+            {
+                settings.shared_hazard_.store(shared, std::memory_order_seq_cst);
+
+                const Filter_Chain* current = shared_filters_.load(std::memory_order_seq_cst);
+                if (current == shared)
+                    break;
+
+                shared = current;
+            }
+
+            bool should_pass = passed_filters(msg, shared->filters, settings.filters().filters);
+
+            settings.shared_hazard_.store(nullptr, std::memory_order_release);
             return should_pass;
         }
+
+        static bool passed_filters(const Message& msg, const Filter_Map& shared, const Filter_Map& own)
+        {
+            if (shared.empty() && own.empty())
+                return false;
+
+            for (auto& filter : shared)
+                if (!filter.second->should_pass(msg))
+                    return false;
+
+            for (auto& filter : own)
+                if (!filter.second->should_pass(msg))
+                    return false;
+
+            return true;
+        }
 };
 
-FPLOG_API Fplog_Impl* g_fplog_impl = 0;
+FPLOG_API std::atomic<Fplog_Impl*> g_fplog_impl(nullptr);
 std::recursive_mutex g_api_mutex;
 
+//Calls that use g_fplog_impl without taking g_api_mutex are counted here, shutdownlog() unpublishes the instance first
+//and deletes it only after every counted call has left, so that a logging thread never touches a deleted instance.
+static std::atomic<unsigned int> g_unlocked_calls(0);
+
+struct Unlocked_Call
+{
+    Unlocked_Call() { g_unlocked_calls.fetch_add(1, std::memory_order_seq_cst); }
+    ~Unlocked_Call() { g_unlocked_calls.fetch_sub(1, std::memory_order_release); }
+
+    //Loaded after the call was counted, nullptr once shutdownlog() started.
+    Fplog_Impl* impl() const { return g_fplog_impl.load(std::memory_order_seq_cst); }
+};
+
+Thread_Settings_Handle::~Thread_Settings_Handle()
+{
+    if (!settings)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(settings->mutex);
+        settings->level_gate_ = nullptr;
+    }
+
+    //g_api_mutex is not taken here, fplog's own threads (mq_reader logging from a receipt) exit while the instance is being deleted
+    Unlocked_Call call;
+    Fplog_Impl* impl = call.impl();
+    if (impl)
+        impl->release_thread_settings(owner_id, settings);
+}
+
+static void write_owned(Message& msg, const Receipt& receipt = Receipt())
+{
+    //per-thread queues path does not take any shared locks, shutdownlog() waits for it to leave
+    {
+        Unlocked_Call call;
+        Fplog_Impl* impl = call.impl();
+        if (impl && impl->write_to_thread_queue(msg, receipt))
+            return;
+    }
+
+    unsigned long long sequence = 0;
+    bool delivered = false;
+
+    {
+        std::lock_guard<std::recursive_mutex> lock(g_api_mutex);
+
+        Fplog_Impl* impl = g_fplog_impl.load();
+        if (impl && !impl->write(msg, receipt, sequence, delivered))
+            return;
+    }
+
+    if (receipt)
+        receipt(sequence, delivered);
+}
+
 void write(const Message& msg)
 {
-    std::lock_guard<std::recursive_mutex> lock(g_api_mutex);
-    
-    if (!g_fplog_impl)
+    if (msg.filtered_out_)
+        return;
+
+    Message copy(msg);
+    write_owned(copy);
+}
+
+void write(Message&& msg)
+{
+    if (msg.filtered_out_)
         return;
-   
-    g_fplog_impl->write(msg);
+
+    write_owned(msg);
+}
+
+void write(Message&& msg, const Receipt& receipt)
+{
+    if (msg.filtered_out_)
+    {
+        if (receipt)
+            receipt(0, false);
+
+        return;
+    }
+
+    write_owned(msg, receipt);
+}
+
+bool flush(size_t timeout)
+{
+    //not holding g_api_mutex while waiting, shutdownlog() stops the wait and then waits for the call to leave
+    Unlocked_Call call;
+    Fplog_Impl* impl = call.impl();
+
+    return impl ? impl->flush(timeout) : true;
 }
 
 void initlog(const char* appname, sprot::Basic_Transport_Interface* transport, bool async_logging)
@@ -821,15 +2686,28 @@ void initlog(const char* appname, sprot::Basic_Transport_Interface* transport, b
     if (!g_fplog_impl)
         g_fplog_impl = new Fplog_Impl();
 
-    return g_fplog_impl->initlog(appname, transport, async_logging);
+    return g_fplog_impl.load()->initlog(appname, transport, async_logging);
 }
 
 void shutdownlog()
 {
-    std::lock_guard<std::recursive_mutex> lock(g_api_mutex);
+    Fplog_Impl* impl = nullptr;
 
-    delete g_fplog_impl;
-    g_fplog_impl = 0;
+    {
+        std::lock_guard<std::recursive_mutex> lock(g_api_mutex);
+        impl = g_fplog_impl.exchange(nullptr, std::memory_order_seq_cst);
+    }
+
+    if (!impl)
+        return;
+
+    //flush() calls in progress return right away, new calls of any kind see no instance
+    impl->stop();
+
+    while (g_unlocked_calls.load(std::memory_order_seq_cst) != 0)
+        std::this_thread::yield();
+
+    delete impl;
 }
 
 void openlog(const char* facility, Filter_Base* filter)
@@ -839,7 +2717,7 @@ void openlog(const char* facility, Filter_Base* filter)
     if (!g_fplog_impl)
         return;
 
-    return g_fplog_impl->openlog(facility, filter);
+    return g_fplog_impl.load()->openlog(facility, filter);
 }
 
 void closelog()
@@ -849,17 +2727,18 @@ void closelog()
     if (!g_fplog_impl)
         return;
 
-    return g_fplog_impl->closelog();
+    return g_fplog_impl.load()->closelog();
 }
 
+//Called by every FPL_* macro, same as write() it does not take g_api_mutex.
 const char* get_facility()
 {
-    std::lock_guard<std::recursive_mutex> lock(g_api_mutex);
-
-    if (!g_fplog_impl)
+    Unlocked_Call call;
+    Fplog_Impl* impl = call.impl();
+    if (!impl)
         return "";
 
-    return g_fplog_impl->get_facility();
+    return impl->get_facility();
 }
 
 void add_filter(Filter_Base* filter)
@@ -869,7 +2748,7 @@ void add_filter(Filter_Base* filter)
     if (!g_fplog_impl)
         return;
 
-    return g_fplog_impl->add_filter(filter);
+    return g_fplog_impl.load()->add_filter(filter);
 }
 
 void remove_filter(Filter_Base* filter)
@@ -879,7 +2758,7 @@ void remove_filter(Filter_Base* filter)
     if (!g_fplog_impl)
         return;
 
-    return g_fplog_impl->remove_filter(filter);
+    return g_fplog_impl.load()->remove_filter(filter);
 }
 
 Filter_Base* find_filter(const char* filter_id)
@@ -889,7 +2768,37 @@ Filter_Base* find_filter(const char* filter_id)
     if (!g_fplog_impl)
         return 0;
 
-    return g_fplog_impl->find_filter(filter_id);
+    return g_fplog_impl.load()->find_filter(filter_id);
+}
+
+void add_shared_filter(Filter_Base* filter)
+{
+    std::lock_guard<std::recursive_mutex> lock(g_api_mutex);
+
+    if (!g_fplog_impl)
+        return;
+
+    return g_fplog_impl.load()->add_shared_filter(filter);
+}
+
+void remove_shared_filter(Filter_Base* filter)
+{
+    std::lock_guard<std::recursive_mutex> lock(g_api_mutex);
+
+    if (!g_fplog_impl)
+        return;
+
+    return g_fplog_impl.load()->remove_shared_filter(filter);
+}
+
+Filter_Base* find_shared_filter(const char* filter_id)
+{
+    std::lock_guard<std::recursive_mutex> lock(g_api_mutex);
+
+    if (!g_fplog_impl)
+        return 0;
+
+    return g_fplog_impl.load()->find_shared_filter(filter_id);
 }
 
 void change_config(const sprot::Params& config)
@@ -899,7 +2808,7 @@ void change_config(const sprot::Params& config)
     if (!g_fplog_impl)
         return;
 
-    return g_fplog_impl->change_config(config);
+    return g_fplog_impl.load()->change_config(config);
 }
 
 FPLOG_API void Fplog_Impl::set_test_mode(bool mode)
@@ -909,34 +2818,83 @@ FPLOG_API void Fplog_Impl::set_test_mode(bool mode)
 
 FPLOG_API void Fplog_Impl::wait_until_queues_are_empty()
 {
-    int counter = 0;
-
-    while (counter < 5)
+    for (;;)
     {
-        bool q1_empty = true;
-
         {
-            std::lock_guard<std::recursive_mutex> lock_q1(mutex_);
-            q1_empty = mq_.empty();
+            std::unique_lock<std::mutex> lock(wakeup_mutex_);
+            reader_progress_.wait(lock, [this](){ return reader_idle_ || stopping_; });
         }
 
-        if (q1_empty)
-        {
-            counter++;
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
-        }
-        else
-        {
-            counter = 0;
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
-        }
+        if (stopping_ || !have_messages())
+            return;
+
+        //reader went to sleep right before new messages arrived, it has been signaled already
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
 }
 
 FPLOG_API void Fplog_Impl::change_config(const sprot::Params& config)
 {
     std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+    std::string ring_path;
+    size_t ring_size = 64 * 1024 * 1024;
+
+    for (auto param : config)
+    {
+        try
+        {
+            if (generic_util::find_str_no_case(param.first, "sequence_lease_size"))
+                sequence_number::set_lease_size(std::stoull(param.second));
+            else if (generic_util::find_str_no_case(param.first, "thread_queue_capacity"))
+                thread_queue_capacity_ = std::stoul(param.second);
+            else if (generic_util::find_str_no_case(param.first, "thread_queues"))
+                use_thread_queues_ = (generic_util::find_str_no_case(param.second, "true") || (param.second == "1"));
+            else if (generic_util::find_str_no_case(param.first, "deferred_formatting"))
+                Message::deferred_formatting_ = (generic_util::find_str_no_case(param.second, "true") || (param.second == "1"));
+            else if (generic_util::find_str_no_case(param.first, "batch_size"))
+                batch_size_ = generic_util::find_str_no_case(param.second, "mtu") ? sprot::implementation::options.mtu : std::stoul(param.second);
+            else if (generic_util::find_str_no_case(param.first, "batch_latency"))
+                batch_latency_ = std::stoul(param.second);
+            else if (generic_util::find_str_no_case(param.first, "batch_adaptive"))
+                batch_adaptive_ = (generic_util::find_str_no_case(param.second, "true") || (param.second == "1"));
+            else if (generic_util::find_str_no_case(param.first, "drop_report_interval"))
+                drop_report_interval_ = std::stoul(param.second);
+            else if (generic_util::find_str_no_case(param.first, "persistent_queue_size"))
+                ring_size = std::stoul(param.second);
+            else if (generic_util::find_str_no_case(param.first, "persistent_queue"))
+                ring_path = param.second;
+        }
+        catch (std::exception&)
+        {
+            continue;
+        }
+    }
+
+    if (!ring_path.empty() && !ring_)
+    {
+        ring_.reset(new Persistent_Ring(ring_path, ring_size));
+
+        if (ring_->is_open())
+        {
+            //messages left by the previous run are sent as soon as there is a transport
+            mq_pushed_ += ring_->recovered();
+            persistent_ = true;
+            notify_reader();
+        }
+        else
+            ring_.reset();
+    }
+
     mq_.apply_config(config);
+
+    std::lock_guard<std::recursive_mutex> queues_lock(thread_queues_mutex_);
+
+    for (auto& param : config)
+        mq_config_[param.first] = param.second;
+
+    for (auto& queue : thread_queues_)
+        queue->mq.apply_config(config);
 }
 
 #ifdef __linux__
@@ -12,14 +12,23 @@
 #include <thread>
 #include <random>
 #include <vector>
+#include <set>
 #include <protocol.h>
-#include <piped_sequence.h>
+#include <shared_sequence.h>
 #include <stdlib.h>
 #include <fplog.h>
 #include <queue_controller.h>
+#include <persistent_ring.h>
+#include <memory_budget.h>
 #include <rapidjson/rapidjson.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
+#include <atomic>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <fstream>
 
 namespace fplog {
 
@@ -31,7 +40,7 @@ class FPLOG_API Fplog_Impl
         void wait_until_queues_are_empty();
 };
 
-FPLOG_API extern Fplog_Impl* g_fplog_impl;
+FPLOG_API extern std::atomic<Fplog_Impl*> g_fplog_impl;
 FPLOG_API extern std::vector<std::string> g_test_results_vector;
 
 };
@@ -1043,7 +1052,7 @@ TEST(Sessions_Test, DISABLED_Large_Transfer)
     EXPECT_TRUE(generic_util::compare_files("reader3.txt", "writer3.txt"));
 }
 
-TEST(Piped_Sequence_Test, DISABLED_Get_Sequence_Number)
+TEST(Shared_Sequence_Test, DISABLED_Get_Sequence_Number)
 {
     using namespace sequence_number;
 
@@ -1056,6 +1065,253 @@ TEST(Piped_Sequence_Test, DISABLED_Get_Sequence_Number)
     EXPECT_GT(s3, s2);
 }
 
+TEST(Shared_Sequence_Test, DISABLED_Leased_Blocks)
+{
+    using namespace sequence_number;
+
+    set_lease_size(4096);
+
+    std::vector<unsigned long long> v1, v2;
+
+    auto take = [](std::vector<unsigned long long>* v)
+    {
+        for (int i = 0; i < 10000; ++i)
+            v->push_back(read_sequence_number());
+    };
+
+    std::thread t1(take, &v1);
+    std::thread t2(take, &v2);
+
+    t1.join();
+    t2.join();
+
+    set_lease_size(0);
+
+    EXPECT_TRUE(std::is_sorted(v1.begin(), v1.end()));
+    EXPECT_TRUE(std::is_sorted(v2.begin(), v2.end()));
+
+    std::vector<unsigned long long> all(v1);
+    all.insert(all.end(), v2.begin(), v2.end());
+    std::sort(all.begin(), all.end());
+
+    EXPECT_EQ(std::adjacent_find(all.begin(), all.end()), all.end());
+    EXPECT_GT(read_sequence_number(), all.back());
+}
+
+//Every process takes sequence numbers for one second and reports how many it got
+//and whether they were strictly increasing, prints total numbers per second for N processes
+//with strict host-wide ordering and with leased blocks.
+TEST(Shared_Sequence_Test, DISABLED_Multiprocess_Throughput)
+{
+    using namespace sequence_number;
+
+    struct Report
+    {
+        unsigned long long count;
+        bool increasing;
+    };
+
+    for (int processes = 1; processes <= 16; processes *= 2)
+    for (unsigned long long lease_size : {0ULL, 4096ULL})
+    {
+        set_lease_size(lease_size);
+
+        std::vector<pid_t> children;
+        std::vector<int> pipes;
+
+        for (int i = 0; i < processes; ++i)
+        {
+            int fds[2];
+            ASSERT_EQ(pipe(fds), 0);
+
+            pid_t pid = fork();
+            ASSERT_NE(pid, -1);
+
+            if (pid == 0)
+            {
+                close(fds[0]);
+
+                Report report = {0, true};
+                unsigned long long prev = 0;
+                auto stop = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+
+                while (std::chrono::steady_clock::now() < stop)
+                {
+                    for (int k = 0; k < 1000; ++k)
+                    {
+                        unsigned long long seq = read_sequence_number();
+                        if (seq <= prev)
+                            report.increasing = false;
+                        prev = seq;
+                    }
+
+                    report.count += 1000;
+                }
+
+                ssize_t written = write(fds[1], &report, sizeof(report));
+                _exit(written == sizeof(report) ? 0 : 1);
+            }
+
+            close(fds[1]);
+            children.push_back(pid);
+            pipes.push_back(fds[0]);
+        }
+
+        unsigned long long total = 0;
+
+        for (int i = 0; i < processes; ++i)
+        {
+            Report report = {0, false};
+            EXPECT_EQ(read(pipes[i], &report, sizeof(report)), static_cast<ssize_t>(sizeof(report)));
+            EXPECT_TRUE(report.increasing);
+
+            total += report.count;
+
+            close(pipes[i]);
+            waitpid(children[i], nullptr, 0);
+        }
+
+        cout << "processes = " << processes << ", lease size = " << lease_size << ", sequence numbers/s = " << total << endl;
+    }
+
+    set_lease_size(0);
+}
+
+TEST(Persistent_Ring_Test, Commit)
+{
+    std::string path("/tmp/fplog2_test_ring_" + std::to_string(getpid()));
+    unlink(path.c_str());
+
+    {
+        Persistent_Ring ring(path, 8192);
+        ASSERT_TRUE(ring.is_open());
+        EXPECT_EQ(ring.recovered(), 0);
+
+        //file is locked while open
+        Persistent_Ring other(path, 8192);
+        EXPECT_FALSE(other.is_open());
+
+        for (int i = 0; i < 100; ++i)
+        {
+            std::string str(std::to_string(i) + std::string(i % 17, '.'));
+            EXPECT_TRUE(ring.push(str.c_str(), str.size()));
+        }
+
+        std::string str;
+        for (int i = 0; i < 10; ++i)
+        {
+            EXPECT_TRUE(ring.read(str));
+            EXPECT_EQ(std::stoi(str), i);
+        }
+
+        ring.commit(5);
+    }
+
+    //read but not committed records come back, so the first 5 are the only ones gone
+    Persistent_Ring ring(path, 1);
+    ASSERT_TRUE(ring.is_open());
+    EXPECT_EQ(ring.recovered(), 95);
+
+    std::string str;
+    for (int i = 5; i < 100; ++i)
+    {
+        EXPECT_TRUE(ring.read(str));
+        EXPECT_EQ(std::stoi(str), i);
+    }
+
+    EXPECT_FALSE(ring.read(str));
+    ring.commit(95);
+
+    //records wrap around the end of the file
+    for (int round = 0; round < 50; ++round)
+    {
+        for (int i = 0; i < 20; ++i)
+        {
+            std::string rec(std::to_string(i) + std::string(i * 7, '.'));
+            EXPECT_TRUE(ring.push(rec.c_str(), rec.size()));
+        }
+
+        for (int i = 0; i < 20; ++i)
+        {
+            EXPECT_TRUE(ring.read(str));
+            EXPECT_EQ(str, std::to_string(i) + std::string(i * 7, '.'));
+        }
+
+        ring.commit(20);
+    }
+
+    unlink(path.c_str());
+}
+
+//Child process writes numbered records as fast as it could, delivering the oldest ones when the ring is full,
+//and gets killed mid-stream. Every record it managed to push and did not deliver has to be found in the file.
+TEST(Persistent_Ring_Test, Crash_Recovery)
+{
+    std::string path("/tmp/fplog2_test_ring_crash_" + std::to_string(getpid()));
+    unlink(path.c_str());
+
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+
+    pid_t pid = fork();
+    ASSERT_NE(pid, -1);
+
+    if (pid == 0)
+    {
+        close(fds[0]);
+
+        Persistent_Ring ring(path, 1024 * 1024);
+        std::string str;
+
+        for (unsigned long long i = 0; ; ++i)
+        {
+            std::string rec(std::to_string(i));
+            while (!ring.push(rec.c_str(), rec.size()))
+            {
+                ring.read(str);
+                ring.commit(1);
+            }
+
+            if ((i == 100000) && (write(fds[1], "x", 1) != 1))
+                _exit(1);
+        }
+    }
+
+    close(fds[1]);
+
+    char c = 0;
+    EXPECT_EQ(read(fds[0], &c, 1), 1);
+    close(fds[0]);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+
+    Persistent_Ring ring(path, 1);
+    ASSERT_TRUE(ring.is_open());
+    EXPECT_GT(ring.recovered(), 0);
+
+    std::string str;
+    long long prev = -1;
+    size_t count = 0;
+
+    while (ring.read(str))
+    {
+        long long num = std::stoll(str);
+        if (prev >= 0)
+        {
+            EXPECT_EQ(num, prev + 1);
+        }
+
+        prev = num;
+        count++;
+    }
+
+    EXPECT_EQ(count, ring.recovered());
+    EXPECT_GE(prev, 100000);
+
+    unlink(path.c_str());
+}
+
 class Bar
 {
     public:
@@ -1074,6 +1330,119 @@ class Foo: public Bar
         }
 };
 
+class Null_Transport: public sprot::Basic_Transport_Interface
+{
+    public:
+
+        size_t read(void*, size_t, size_t = infinite_wait){ return 0; }
+        size_t write(const void*, size_t buf_size, size_t = infinite_wait){ written_++; return buf_size; }
+
+        std::atomic<unsigned long long> written_{0};
+};
+
+static Null_Transport g_null_transport;
+
+//Keeps every frame written to it, writes wait while the transport is closed.
+class Capturing_Transport: public sprot::Basic_Transport_Interface
+{
+    public:
+
+        size_t read(void*, size_t, size_t = infinite_wait){ return 0; }
+        size_t write(const void* buf, size_t buf_size, size_t = infinite_wait)
+        {
+            entered_ = true;
+
+            while (!open_)
+                std::this_thread::yield();
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                frames_.push_back(std::string(static_cast<const char*>(buf), buf_size));
+            }
+
+            written_++;
+            return buf_size;
+        }
+
+        std::vector<std::string> frames()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return frames_;
+        }
+
+        std::atomic<bool> entered_{false}; //set by the first write
+        std::atomic<bool> open_{true};
+        std::atomic<unsigned long long> written_{0};
+
+
+    private:
+
+        std::mutex mutex_;
+        std::vector<std::string> frames_;
+};
+
+//Texts of the messages in the captured frames in the order they were sent, batch frames are unpacked.
+static std::vector<std::string> delivered_texts(const std::vector<std::string>& frames)
+{
+    std::vector<std::string> texts;
+
+    for (auto& frame : frames)
+    {
+        rapidjson::Document doc;
+        doc.Parse(frame.c_str());
+
+        EXPECT_FALSE(doc.HasParseError()) << frame;
+        if (doc.HasParseError() || !doc.IsObject())
+            continue;
+
+        if (!doc.HasMember("batch"))
+        {
+            if (doc.HasMember("text"))
+                texts.push_back(doc["text"].GetString());
+
+            continue;
+        }
+
+        EXPECT_TRUE(doc["batch"].IsArray()) << frame;
+        if (!doc["batch"].IsArray())
+            continue;
+
+        for (auto& msg : doc["batch"].GetArray())
+            if (msg.IsObject() && msg.HasMember("text"))
+                texts.push_back(msg["text"].GetString());
+    }
+
+    return texts;
+}
+
+//Writes a lone message and returns how many ms passed until the transport got it.
+static long long delivery_time(Capturing_Transport& transport, fplog::Prio_Level::Type prio, const char* text)
+{
+    unsigned long long written = transport.written_;
+    auto start = std::chrono::steady_clock::now();
+
+    fplog::write(fplog::Message(prio, fplog::Facility::user, text));
+
+    while ((transport.written_ == written) && (std::chrono::steady_clock::now() - start < std::chrono::seconds(5)))
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+//Brings back the sync test mode instance that tests expect, for tests that shut it down.
+static void restore_test_log()
+{
+    try
+    {
+        fplog::initlog("fplog_test", nullptr, false);
+    }
+    catch (fplog::exceptions::Transport_Missing&)
+    {
+    }
+
+    fplog::g_fplog_impl.load()->set_test_mode(true);
+}
+
 void prepare_api_test()
 {
     fplog::g_test_results_vector.clear();
@@ -1166,33 +1535,829 @@ TEST(Fplog_Api_Test, DISABLED_Filters)
         fplog::write(msg);
     }
 
-    filter->remove(fplog::Prio::emergency);
+    filter->remove(fplog::Prio::emergency);
+
+    {
+        fplog::Message msg(fplog::Prio::emergency, fplog::Facility::system, "this is invisible emergency");
+        fplog::write(msg);
+    }
+
+    remove_filter(filter);
+
+    {
+        fplog::Message msg(fplog::Prio::debug, fplog::Facility::system, "this debug message should be invisible");
+        fplog::write(msg);
+    }
+
+    EXPECT_EQ(fplog::g_test_results_vector.size(), 2);
+    EXPECT_EQ("{\"priority\":\"emergency\",\"facility\":\"system\",\"text\":\"this emergency message is visible\",\"appname\":\"fplog_test\"}", fplog::g_test_results_vector[0]);
+    EXPECT_EQ("{\"priority\":\"debug\",\"facility\":\"system\",\"text\":\"along with this debug message\",\"appname\":\"fplog_test\"}", fplog::g_test_results_vector[1]);
+
+    fplog::closelog();
+}
+
+TEST(Fplog_Api_Test, Level_Gate)
+{
+    prepare_api_test();
+
+    fplog::Priority_Filter* filter = dynamic_cast<fplog::Priority_Filter*>(fplog::find_filter("prio_filter"));
+    if (!filter)
+    {
+        EXPECT_NE(filter, nullptr);
+        return;
+    }
+
+    filter->remove();
+    filter->add(fplog::Prio::warning);
+
+    EXPECT_FALSE(fplog::level_gate_open(fplog::Prio_Level::debug));
+    EXPECT_TRUE(fplog::level_gate_open(fplog::Prio_Level::warning));
+
+    EXPECT_EQ(&FPL_TRACE("this trace is never built %d", 1).add("param", 2), &fplog::Message::filtered_out());
+    EXPECT_EQ(FPL_TRACE("this trace is never built %d", 1).add("param", 2).as_string(), "{}");
+
+    fplog::write(FPL_TRACE("this trace is never built %d", 1).add("param", 2));
+    fplog::write(FPL_WARN("this warning is visible"));
+
+    remove_filter(filter);
+    EXPECT_FALSE(fplog::level_gate_open(fplog::Prio_Level::warning));
+
+    fplog::closelog();
+    EXPECT_TRUE(fplog::level_gate_open(fplog::Prio_Level::debug));
+
+    EXPECT_EQ(fplog::g_test_results_vector.size(), 1);
+}
+
+static std::string strip_timestamp_and_sequence(std::string input)
+{
+    generic_util::remove_json_field(fplog::Message::Mandatory_Fields::timestamp, input);
+    generic_util::remove_json_field(fplog::Message::Optional_Fields::sequence, input);
+
+    return input;
+}
+
+TEST(Fplog_Api_Test, Numeric_Priority)
+{
+    prepare_api_test();
+
+    fplog::Priority_Filter* filter = dynamic_cast<fplog::Priority_Filter*>(fplog::find_filter("prio_filter"));
+    if (!filter)
+    {
+        EXPECT_NE(filter, nullptr);
+        return;
+    }
+
+    filter->remove();
+    filter->add(fplog::Prio::warning);
+
+    fplog::Message numeric(fplog::Prio_Level::warning, fplog::Facility::system, "numeric %s", "warning");
+    EXPECT_EQ("{\"priority\":\"warning\",\"facility\":\"system\",\"text\":\"numeric warning\"}", strip_timestamp_and_sequence(numeric.as_string()));
+
+    fplog::write(numeric);
+    fplog::write(fplog::Message(fplog::Prio_Level::debug, fplog::Facility::system, "numeric debug is filtered out"));
+    fplog::write(fplog::Message(std::string("{\"priority\":\"warning\",\"facility\":\"system\",\"text\":\"parsed warning\"}")));
+    fplog::write(fplog::Message(std::string("{\"priority\":\"debug\",\"facility\":\"system\",\"text\":\"parsed debug is filtered out\"}")));
+
+    remove_filter(filter);
+    fplog::closelog();
+
+    EXPECT_EQ(fplog::g_test_results_vector.size(), 2);
+}
+
+TEST(Fplog_Api_Test, Call_Site_Class_Names)
+{
+    struct Logger
+    {
+        virtual ~Logger() {}
+        std::string log() { return strip_timestamp_and_sequence(FPL_CINFO("call site").as_string()); }
+    };
+
+    struct Derived_Logger: public Logger
+    {
+    };
+
+    Logger base;
+    Derived_Logger derived;
+
+    std::string base_msg(base.log());
+    std::string derived_msg(derived.log());
+
+    EXPECT_NE(base_msg.find("\"module\":\"main.cpp\""), std::string::npos);
+    EXPECT_NE(base_msg.find("\"method\":\"log\""), std::string::npos);
+    EXPECT_NE(base_msg.find("Logger\"}"), std::string::npos);
+    EXPECT_NE(derived_msg.find("Derived_Logger\"}"), std::string::npos);
+    EXPECT_EQ(base_msg, base.log());
+}
+
+TEST(Fplog_Api_Test, Deferred_Formatting)
+{
+    std::string captured("text");
+    const char* null_str = 0;
+
+    auto capture = [](auto... args)
+    {
+        std::vector<char> buffer(fplog::Deferred_Text::capture_size(args...));
+        fplog::Deferred_Text::capture(buffer.data(), args...);
+        return buffer;
+    };
+
+    std::vector<char> deferred(capture("%d|%5u|%-4x|%lld|%.2f|%e|%c|%s|%s|%*d|%.*f|100%%", -7, 42u, 255, -1234567890123LL, 3.14159f,
+                                       2.5, 'z', captured.c_str(), null_str, 6, 8, 2, 1.0 / 3));
+    captured = "changed after capture";
+
+    char expected[256] = {0};
+    snprintf(expected, sizeof(expected) - 1, "%d|%5u|%-4x|%lld|%.2f|%e|%c|%s|%s|%*d|%.*f|100%%", -7, 42u, 255, -1234567890123LL, 3.14159,
+             2.5, 'z', "text", "(null)", 6, 8, 2, 1.0 / 3);
+
+    EXPECT_EQ(fplog::Deferred_Text::format(deferred.data(), deferred.size()), expected);
+
+    fplog::change_config({{"deferred_formatting", "true"}});
+    fplog::Message msg(fplog::Prio_Level::info, fplog::Facility::user, "deferred %s #%d", "message", 1);
+    fplog::change_config({{"deferred_formatting", "false"}});
+
+    EXPECT_TRUE(msg.text().empty());
+    EXPECT_TRUE(msg.timestamp().empty());
+
+    fplog::Message copied(msg);
+    fplog::Message moved(std::move(msg));
+
+    EXPECT_EQ(strip_timestamp_and_sequence(moved.as_string()), "{\"priority\":\"info\",\"facility\":\"user\",\"text\":\"deferred message #1\"}");
+    EXPECT_EQ(copied.as_string(), moved.as_string());
+    EXPECT_NE(moved.as_string().find("\"timestamp\":"), std::string::npos);
+}
+
+TEST(Fplog_Api_Test, Field_Accessors)
+{
+    fplog::Message msg(fplog::Message(fplog::Prio::notice, fplog::Facility::security, "accessor test").as_string());
+
+    EXPECT_EQ(msg.priority(), "notice");
+    EXPECT_EQ(msg.facility(), "security");
+    EXPECT_EQ(msg.text(), "accessor test");
+    EXPECT_FALSE(msg.timestamp().empty());
+    EXPECT_EQ(msg.sequence(), 0ULL);
+
+    msg.add("number", 5);
+
+    ASSERT_NE(msg.find("number"), nullptr);
+    EXPECT_EQ(msg.find("number")->GetInt(), 5);
+    EXPECT_EQ(msg.find("missing"), nullptr);
+    EXPECT_TRUE(msg.find_string("number").empty());
+}
+
+TEST(Fplog_Api_Test, Priority_Filter_Mask)
+{
+    fplog::Priority_Filter filter("mask_test");
+
+    filter.add_all_above("warn", true);
+    EXPECT_EQ(filter.level_mask(), 0x1F);
+
+    filter.add_all_below(fplog::Prio::error);
+    EXPECT_EQ(filter.level_mask(), 0xF0);
+
+    filter.remove(fplog::Prio::debug);
+    filter.add(fplog::Prio::alert);
+    EXPECT_EQ(filter.level_mask(), 0x72);
+
+    filter.add("custom");
+    EXPECT_TRUE(filter.should_pass(fplog::Message(std::string("{\"priority\":\"custom\"}"))));
+    EXPECT_FALSE(filter.should_pass(fplog::Message(std::string("{\"priority\":\"other\"}"))));
+    EXPECT_TRUE(filter.should_pass(fplog::Message(fplog::Prio_Level::info, fplog::Facility::user)));
+    EXPECT_FALSE(filter.should_pass(fplog::Message(fplog::Prio_Level::debug, fplog::Facility::user)));
+
+    filter.remove();
+    EXPECT_EQ(filter.level_mask(), 0);
+    EXPECT_FALSE(filter.should_pass(fplog::Message(std::string("{\"priority\":\"custom\"}"))));
+
+    //threads toggling different priorities must not lose each other's bits
+    filter.add(fplog::Prio_Level::emergency);
+
+    std::vector<std::thread> threads;
+    for (int level = fplog::Prio_Level::alert; level <= fplog::Prio_Level::debug; ++level)
+        threads.emplace_back([&filter, level]()
+        {
+            for (int i = 0; i < 10000; ++i)
+            {
+                filter.add(static_cast<fplog::Prio_Level::Type>(level));
+                filter.remove(static_cast<fplog::Prio_Level::Type>(level));
+            }
+        });
+
+    for (auto& thread : threads)
+        thread.join();
+
+    EXPECT_EQ(filter.level_mask(), 0x01);
+}
+
+TEST(Fplog_Api_Test, Filter_Snapshots)
+{
+    prepare_api_test();
+
+    fplog::Priority_Filter* filter = dynamic_cast<fplog::Priority_Filter*>(fplog::find_filter("prio_filter"));
+    if (!filter)
+    {
+        EXPECT_NE(filter, nullptr);
+        return;
+    }
+
+    std::atomic<bool> done(false);
+
+    std::thread reconfigure([&]()
+    {
+        for (int i = 0; i < 1000; ++i)
+        {
+            filter->remove(fplog::Prio_Level::info);
+            filter->add(fplog::Prio_Level::info);
+            filter->add("custom");
+            filter->remove("custom");
+        }
+
+        done = true;
+    });
+
+    while (!done)
+        fplog::write(FPL_INFO("logging while filters change"));
+
+    reconfigure.join();
+
+    EXPECT_TRUE(fplog::level_gate_open(fplog::Prio_Level::info));
+
+    filter->remove(fplog::Prio_Level::info);
+    EXPECT_FALSE(fplog::level_gate_open(fplog::Prio_Level::info));
+
+    fplog::add_filter(new fplog::Priority_Filter("second_filter"));
+    EXPECT_NE(fplog::find_filter("second_filter"), nullptr);
+    EXPECT_FALSE(fplog::level_gate_open(fplog::Prio_Level::emergency));
+
+    fplog::remove_filter(fplog::find_filter("second_filter"));
+    EXPECT_EQ(fplog::find_filter("second_filter"), nullptr);
+    EXPECT_TRUE(fplog::level_gate_open(fplog::Prio_Level::emergency));
+
+    fplog::closelog();
+}
+
+TEST(Fplog_Api_Test, Shared_Filters)
+{
+    fplog::g_test_results_vector.clear();
+
+    fplog::Priority_Filter* shared = new fplog::Priority_Filter("shared_prio");
+    shared->add(fplog::Prio_Level::warning);
+
+    fplog::add_shared_filter(shared);
+    EXPECT_EQ(fplog::find_shared_filter("shared_prio"), shared);
+    EXPECT_TRUE(fplog::level_gate_open(fplog::Prio_Level::warning));
+    EXPECT_FALSE(fplog::level_gate_open(fplog::Prio_Level::info));
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < 4; ++i)
+        workers.emplace_back([]()
+        {
+            fplog::write(FPL_WARN("shared warning"));
+            fplog::write(FPL_INFO("shared info"));
+        });
+
+    for (auto& worker : workers)
+        worker.join();
+
+    EXPECT_EQ(fplog::g_test_results_vector.size(), 4);
+
+    shared->add(fplog::Prio_Level::info);
+
+    bool info_open = false;
+    std::thread pool_thread([&](){ info_open = fplog::level_gate_open(fplog::Prio_Level::info); });
+    pool_thread.join();
+
+    EXPECT_TRUE(info_open);
+
+    fplog::g_test_results_vector.clear();
+
+    std::thread narrowed([]()
+    {
+        fplog::Priority_Filter* own = new fplog::Priority_Filter("own_prio");
+        own->add(fplog::Prio_Level::error);
+        fplog::openlog(fplog::Facility::user, own);
+
+        fplog::write(FPL_WARN("not allowed by own filter"));
+        fplog::write(FPL_INFO("not allowed by own filter either"));
+
+        fplog::closelog();
+    });
+
+    narrowed.join();
+
+    EXPECT_EQ(fplog::g_test_results_vector.size(), 0);
+
+    fplog::remove_shared_filter(shared);
+    EXPECT_EQ(fplog::find_shared_filter("shared_prio"), nullptr);
+    EXPECT_TRUE(fplog::level_gate_open(fplog::Prio_Level::info));
+}
+
+TEST(Fplog_Api_Test, Delivery_Receipts)
+{
+    prepare_api_test();
+
+    fplog::Priority_Filter* filter = dynamic_cast<fplog::Priority_Filter*>(fplog::find_filter("prio_filter"));
+    if (!filter)
+    {
+        EXPECT_NE(filter, nullptr);
+        return;
+    }
+
+    filter->remove(fplog::Prio_Level::info);
+
+    std::vector<std::pair<unsigned long long, bool>> receipts;
+    auto receipt = [&](unsigned long long sequence, bool delivered){ receipts.push_back(std::make_pair(sequence, delivered)); };
+
+    fplog::write(fplog::Message(fplog::Prio::warning, fplog::Facility::user, "delivered"), receipt);
+    fplog::write(fplog::Message(fplog::Prio::info, fplog::Facility::user, "filtered out"), receipt);
+
+    EXPECT_TRUE(fplog::flush(100));
+
+    if (receipts.size() != 2)
+    {
+        EXPECT_EQ(receipts.size(), 2);
+        return;
+    }
+
+    EXPECT_TRUE(receipts[0].second);
+    EXPECT_FALSE(receipts[1].second);
+
+    //receipts known right away are called without holding any locks, so other threads could log meanwhile
+    bool logged = false;
+
+    fplog::write(fplog::Message(fplog::Prio::warning, fplog::Facility::user, "delivered"), [&](unsigned long long, bool)
+    {
+        std::thread([&]()
+        {
+            fplog::write(fplog::Message(fplog::Prio::warning, fplog::Facility::user, "logged while receipt runs"));
+            logged = true;
+        }).join();
+    });
+
+    EXPECT_TRUE(logged);
+
+    fplog::closelog();
+}
+
+//Receipts go by the sequence numbers of the messages that were sent, "sequence" in the text or user fields of another
+//message must not confirm a message that is still queued.
+TEST(Fplog_Api_Test, Receipts_Ignore_Sequence_In_Fields)
+{
+    Capturing_Transport transport;
+    transport.open_ = false;
+
+    fplog::shutdownlog();
+    fplog::initlog("fplog_test", &transport, true);
+
+    fplog::Priority_Filter* filter = new fplog::Priority_Filter("receipts_prio");
+    filter->add_all_above(fplog::Prio::debug, true);
+    fplog::openlog(fplog::Facility::user, filter);
+
+    unsigned long long lease_size = sequence_number::get_lease_size();
+    sequence_number::set_lease_size(1000);
+
+    std::mutex mutex;
+    std::map<unsigned long long, unsigned long long> written_before; //sequence -> messages written when its receipt ran
+
+    auto receipt = [&](unsigned long long sequence, bool delivered)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        written_before[sequence] = delivered ? transport.written_.load() : 0;
+    };
+
+    fplog::write(fplog::Message(fplog::Prio::info, fplog::Facility::user, "holds the transport"));
+
+    while (!transport.entered_) //mq_reader is stuck in the first write from now on
+        std::this_thread::yield();
+
+    //numbers of this thread come from its lease, so the next two messages are most likely numbered next + 1 and next + 2
+    unsigned long long next = sequence_number::read_sequence_number();
+    std::string mentioned(std::to_string(next + 2));
+
+    fplog::write(fplog::Message("{\"priority\":\"info\",\"facility\":\"user\",\"text\":\"\\\"sequence\\\":" + mentioned + "\","
+                                "\"request\":{\"sequence\":" + mentioned + "}}"), receipt);
+    fplog::write(fplog::Message(fplog::Prio::info, fplog::Facility::user, "second"), receipt);
+
+    transport.open_ = true;
+    EXPECT_TRUE(fplog::flush(1000));
+
+    sequence_number::set_lease_size(lease_size);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        EXPECT_EQ(written_before.size(), 2);
+        for (auto& receipt : written_before)
+        {
+            EXPECT_GE(receipt.second, 2); //holding message and at least the message of the receipt itself
+        }
+
+        auto second(written_before.find(next + 2));
+        if (second != written_before.end())
+        {
+            EXPECT_EQ(second->second, 3);
+        }
+    }
+
+    fplog::closelog();
+    fplog::shutdownlog();
+    restore_test_log();
+}
+
+//Messages that did not fit into a full per-thread queue are reported the same way as drops of queue policies.
+TEST(Fplog_Api_Test, Thread_Queue_Overflow_Report)
+{
+    Capturing_Transport transport;
+    transport.open_ = false;
+
+    fplog::shutdownlog();
+    fplog::initlog("fplog_test", &transport, true);
+
+    sprot::Params params;
+    params["thread_queues"] = "true";
+    params["thread_queue_capacity"] = "2";
+    params["drop_report_interval"] = "20";
+    fplog::change_config(params);
+
+    fplog::Priority_Filter* filter = new fplog::Priority_Filter("overflow_prio");
+    filter->add_all_above(fplog::Prio::debug, true);
+    fplog::openlog(fplog::Facility::user, filter);
+
+    const int count = 20;
+
+    fplog::write(fplog::Message(fplog::Prio_Level::info, fplog::Facility::user, "ring message"));
+
+    while (!transport.entered_) //mq_reader holds the first message, the ring is not drained from now on
+        std::this_thread::yield();
+
+    for (int i = 1; i < count; ++i)
+        fplog::write(fplog::Message(fplog::Prio_Level::info, fplog::Facility::user, "ring message"));
+
+    transport.open_ = true;
+    EXPECT_TRUE(fplog::flush(1000));
+
+    int delivered = 0;
+    long long dropped = -1;
+
+    for (int attempt = 0; (attempt < 100) && (dropped < 0); ++attempt)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        delivered = 0;
+        for (auto& frame : transport.frames())
+        {
+            fplog::Message msg(frame);
+
+            if (msg.text() == "ring message")
+                delivered++;
+            else if (msg.find("dropped_info"))
+                dropped = msg.find("dropped_info")->GetInt64();
+        }
+    }
+
+    EXPECT_GT(dropped, 0);
+    EXPECT_EQ(delivered + dropped, count);
+
+    fplog::closelog();
+    fplog::shutdownlog();
+    restore_test_log();
+}
+
+//Messages that pile up while the transport is busy are sent in batch frames, each one a valid message
+//with the queued messages in its batch array, in the order they were written.
+TEST(Fplog_Api_Test, Batch_Frames)
+{
+    Capturing_Transport transport;
+    transport.open_ = false;
+
+    fplog::shutdownlog();
+    fplog::initlog("fplog_test", &transport, true);
+
+    sprot::Params params;
+    params["batch_size"] = "4096";
+    params["batch_latency"] = "0";
+    params["batch_adaptive"] = "false";
+    fplog::change_config(params);
+
+    fplog::Priority_Filter* filter = new fplog::Priority_Filter("batch_prio");
+    filter->add_all_above(fplog::Prio::debug, true);
+    fplog::openlog(fplog::Facility::user, filter);
+
+    const int count = 60;
+    std::vector<std::string> expected;
+
+    for (int i = 0; i < count; ++i)
+    {
+        expected.push_back("batch " + std::to_string(i));
+        fplog::write(fplog::Message(fplog::Prio_Level::info, fplog::Facility::user, expected.back().c_str()));
+
+        while ((i == 0) && !transport.entered_) //the rest queues up behind the first one
+            std::this_thread::yield();
+    }
+
+    transport.open_ = true;
+    EXPECT_TRUE(fplog::flush(2000));
+
+    std::vector<std::string> frames(transport.frames());
+    EXPECT_EQ(delivered_texts(frames), expected);
+    EXPECT_LT(frames.size(), static_cast<size_t>(count));
+
+    for (auto& frame : frames)
+    {
+        EXPECT_LE(frame.size(), 4096);
+    }
+
+    fplog::closelog();
+    fplog::shutdownlog();
+    restore_test_log();
+}
+
+//Batch target starts at zero, so a lone message is sent right away, grows while messages pile up, after that lone messages
+//wait for company up to batch_latency and every wait that ends at the deadline halves the target. Errors never wait.
+TEST(Fplog_Api_Test, Adaptive_Batching)
+{
+    Capturing_Transport transport;
+
+    fplog::shutdownlog();
+    fplog::initlog("fplog_test", &transport, true);
+
+    sprot::Params params;
+    params["batch_size"] = "4096";
+    params["batch_latency"] = "300";
+    params["batch_adaptive"] = "true";
+    fplog::change_config(params);
+
+    fplog::Priority_Filter* filter = new fplog::Priority_Filter("adaptive_prio");
+    filter->add_all_above(fplog::Prio::debug, true);
+    fplog::openlog(fplog::Facility::user, filter);
+
+    EXPECT_LT(delivery_time(transport, fplog::Prio_Level::info, "lone before burst"), 150);
+
+    transport.entered_ = false;
+    transport.open_ = false;
+
+    for (int i = 0; i < 200; ++i)
+    {
+        fplog::write(fplog::Message(fplog::Prio_Level::info, fplog::Facility::user, "burst"));
+
+        while ((i == 0) && !transport.entered_)
+            std::this_thread::yield();
+    }
+
+    transport.open_ = true;
+    EXPECT_TRUE(fplog::flush(5000));
+
+    EXPECT_LT(delivery_time(transport, fplog::Prio_Level::error, "urgent"), 150);
+    EXPECT_GE(delivery_time(transport, fplog::Prio_Level::info, "lone after burst"), 250);
+
+    bool shrunk = false;
+    for (int i = 0; (i < 10) && !shrunk; ++i)
+        shrunk = (delivery_time(transport, fplog::Prio_Level::info, "lone") < 150);
+
+    EXPECT_TRUE(shrunk);
+
+    fplog::closelog();
+    fplog::shutdownlog();
+    restore_test_log();
+}
+
+//Idle mq_reader sleeps until a producer wakes it up, so a message written after a quiet period does not wait
+//for the next poll, which used to be up to 10 ms away.
+TEST(Fplog_Api_Test, Idle_Wakeup)
+{
+    Capturing_Transport transport;
+
+    fplog::shutdownlog();
+    fplog::initlog("fplog_test", &transport, true);
+
+    fplog::Priority_Filter* filter = new fplog::Priority_Filter("wakeup_prio");
+    filter->add_all_above(fplog::Prio::debug, true);
+    fplog::openlog(fplog::Facility::user, filter);
+
+    const int count = 20;
+    long long total = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+        unsigned long long written = transport.written_;
+        auto start = std::chrono::steady_clock::now();
+
+        fplog::write(fplog::Message(fplog::Prio_Level::info, fplog::Facility::user, "wakeup"));
+
+        while ((transport.written_ == written) && (std::chrono::steady_clock::now() - start < std::chrono::seconds(1)))
+            std::this_thread::yield();
+
+        total += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    EXPECT_EQ(transport.written_, count);
+    EXPECT_LT(total / count, 2000);
+
+    fplog::closelog();
+    fplog::shutdownlog();
+    restore_test_log();
+}
+
+//Child process queues messages into the persistent queue while the transport holds them and gets killed.
+//Next run has to send every one of them exactly once and commit them, so that the run after it finds nothing.
+TEST(Fplog_Api_Test, Persistent_Queue_Replay)
+{
+    std::string path("/tmp/fplog2_test_persistent_queue_" + std::to_string(getpid()));
+    unlink(path.c_str());
+
+    sprot::Params params;
+    params["persistent_queue"] = path;
+    params["persistent_queue_size"] = "1048576";
+
+    const int count = 10;
+
+    //the child must not inherit a running mq_reader
+    fplog::shutdownlog();
+
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+
+    pid_t pid = fork();
+    ASSERT_NE(pid, -1);
+
+    if (pid == 0)
+    {
+        close(fds[0]);
+
+        Capturing_Transport transport;
+        transport.open_ = false;
+
+        fplog::initlog("fplog_test", &transport, true);
+        fplog::change_config(params);
+
+        fplog::Priority_Filter* filter = new fplog::Priority_Filter("persistent_prio");
+        filter->add_all_above(fplog::Prio::debug, true);
+        fplog::openlog(fplog::Facility::user, filter);
+
+        for (int i = 0; i < count; ++i)
+            fplog::write(fplog::Message(fplog::Prio_Level::info, fplog::Facility::user, ("persistent " + std::to_string(i)).c_str()));
+
+        if (write(fds[1], "x", 1) != 1)
+            _exit(1);
+
+        for (;;)
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+
+    close(fds[1]);
+
+    char c = 0;
+    EXPECT_EQ(read(fds[0], &c, 1), 1);
+    close(fds[0]);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+
+    Capturing_Transport transport;
+    fplog::initlog("fplog_test", &transport, true);
+    fplog::change_config(params);
+
+    //recovered messages are counted as queued, so flush waits for them
+    EXPECT_TRUE(fplog::flush(2000));
+
+    std::vector<std::string> frames(transport.frames());
+
+    for (int i = 0; i < count; ++i)
+    {
+        std::string text("\"persistent " + std::to_string(i) + "\"");
+        int found = 0;
+
+        for (auto& frame : frames)
+            for (size_t pos = frame.find(text); pos != std::string::npos; pos = frame.find(text, pos + 1))
+                found++;
+
+        EXPECT_EQ(found, 1) << text;
+    }
+
+    fplog::shutdownlog();
+    restore_test_log();
+
+    //everything the transport accepted is committed
+    {
+        Persistent_Ring ring(path, 1);
+        ASSERT_TRUE(ring.is_open());
+        EXPECT_EQ(ring.recovered(), 0);
+        EXPECT_FALSE(ring.has_unread());
+    }
+
+    unlink(path.c_str());
+}
+
+TEST(Fplog_Api_Test, Shutdown_While_Logging)
+{
+    fplog::shutdownlog();
+    fplog::initlog("fplog_test", &g_null_transport, true);
+
+    sprot::Params params;
+    params["thread_queues"] = "true";
+    fplog::change_config(params);
+
+    std::atomic<bool> stop(false);
+    std::atomic<unsigned int> written(0);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.push_back(std::thread([&]()
+        {
+            fplog::Priority_Filter* filter = new fplog::Priority_Filter("shutdown_prio");
+            filter->add_all_above(fplog::Prio::debug, true);
+            fplog::openlog(fplog::Facility::user, filter);
+
+            while (!stop)
+            {
+                unsigned int num = written++;
+                fplog::write(FPL_INFO("message #%u", num));
+
+                if (num % 100 == 0)
+                    fplog::flush(10);
+            }
+
+            fplog::closelog();
+        }));
+    }
+
+    while (written < 1000)
+        std::this_thread::yield();
+
+    //loggers keep going while the instance is deleted and afterwards
+    fplog::shutdownlog();
+
+    unsigned int after_shutdown = written + 1000;
+    while (written < after_shutdown)
+        std::this_thread::yield();
+
+    stop = true;
+
+    for (auto& thread : threads)
+        thread.join();
+
+    EXPECT_GT(g_null_transport.written_, 0);
+
+    restore_test_log();
+}
+
+//Receipts run on mq_reader, logging from one registers thread settings of mq_reader,
+//which are released when it exits during shutdownlog().
+TEST(Fplog_Api_Test, Shutdown_After_Logging_From_Receipt)
+{
+    fplog::shutdownlog();
+    fplog::initlog("fplog_test", &g_null_transport, true);
+
+    std::atomic<int> receipts(0);
+
+    for (int i = 0; i < 10; ++i)
+        fplog::write(fplog::Message(fplog::Prio_Level::info, fplog::Facility::user, "message #%d", i), [&](unsigned long long, bool)
+        {
+            fplog::write(fplog::Message(fplog::Prio_Level::info, fplog::Facility::user, "logged from a receipt"));
+            receipts++;
+        });
+
+    EXPECT_TRUE(fplog::flush(1000));
+    EXPECT_EQ(receipts, 10);
+
+    fplog::shutdownlog();
+
+    restore_test_log();
+}
+
+TEST(Fplog_Api_Test, Thread_Settings)
+{
+    prepare_api_test();
+
+    std::string other_facility, reopened_facility;
+    fplog::Filter_Base* other_filter = nullptr;
+    bool other_gate_open = true;
 
+    std::thread other([&]()
     {
-        fplog::Message msg(fplog::Prio::emergency, fplog::Facility::system, "this is invisible emergency");
-        fplog::write(msg);
-    }
+        other_facility = fplog::get_facility();
+        other_filter = fplog::find_filter("prio_filter");
 
-    remove_filter(filter);
-
-    {
-        fplog::Message msg(fplog::Prio::debug, fplog::Facility::system, "this debug message should be invisible");
-        fplog::write(msg);
-    }
+        fplog::openlog(fplog::Facility::system, new fplog::Priority_Filter("other_filter"));
+        reopened_facility = fplog::get_facility();
+        other_gate_open = fplog::level_gate_open(fplog::Prio_Level::debug);
+    });
 
-    EXPECT_EQ(fplog::g_test_results_vector.size(), 2);
-    EXPECT_EQ("{\"priority\":\"emergency\",\"facility\":\"system\",\"text\":\"this emergency message is visible\",\"appname\":\"fplog_test\"}", fplog::g_test_results_vector[0]);
-    EXPECT_EQ("{\"priority\":\"debug\",\"facility\":\"system\",\"text\":\"along with this debug message\",\"appname\":\"fplog_test\"}", fplog::g_test_results_vector[1]);
+    other.join();
 
-    fplog::closelog();
-}
+    EXPECT_EQ(other_facility, fplog::Facility::user);
+    EXPECT_EQ(other_filter, nullptr);
+    EXPECT_EQ(reopened_facility, fplog::Facility::system);
+    EXPECT_FALSE(other_gate_open);
 
-static std::string strip_timestamp_and_sequence(std::string input)
-{
-    generic_util::remove_json_field(fplog::Message::Mandatory_Fields::timestamp, input);
-    generic_util::remove_json_field(fplog::Message::Optional_Fields::sequence, input);
+    EXPECT_STREQ(fplog::get_facility(), fplog::Facility::security);
+    EXPECT_NE(fplog::find_filter("prio_filter"), nullptr);
+    EXPECT_EQ(fplog::find_filter("other_filter"), nullptr);
 
-    return input;
+    fplog::closelog();
+    EXPECT_STREQ(fplog::get_facility(), fplog::Facility::user);
 }
 
 TEST(Fplog_Api_Test, Batching)
@@ -1385,6 +2550,56 @@ TEST(Queue_Controller_Test, DISABLED_Remove_Oldest)
     }
 }
 
+//Checks that messages dropped by a *_Below_Priority algo are below warning and come from the least important lane first,
+//newest or oldest ones within that lane.
+static void check_lane_drops(const std::vector<std::string>& pushed, const std::vector<std::string*>& remaining, bool newest)
+{
+    auto num = [](const std::string& str) -> int
+    {
+        size_t pos = str.find("\"num\":");
+        return (pos == std::string::npos) ? -1 : std::stoi(str.substr(pos + 6));
+    };
+
+    std::set<int> kept;
+    for (auto str : remaining)
+        kept.insert(num(*str));
+
+    int lowest_dropped_lane = Queue_Controller::lane_count;
+    for (auto& str : pushed)
+    {
+        if (kept.find(num(str)) != kept.end())
+            continue;
+
+        int lane = Queue_Controller::lane(str);
+        EXPECT_GT(lane, fplog::Prio_Level::warning);
+        lowest_dropped_lane = std::min(lowest_dropped_lane, lane);
+    }
+
+    for (auto& str : pushed)
+    {
+        int lane = Queue_Controller::lane(str);
+        if ((lane <= lowest_dropped_lane) || (lane == Queue_Controller::unknown_lane) || (kept.find(num(str)) == kept.end()))
+            continue;
+
+        cout << "Less important message was kept while more important one was dropped: " << str << std::endl;
+        EXPECT_TRUE(false);
+    }
+
+    for (auto& dropped : pushed)
+    {
+        if ((kept.find(num(dropped)) != kept.end()) || (Queue_Controller::lane(dropped) != lowest_dropped_lane))
+            continue;
+
+        for (auto& str : pushed)
+        {
+            if ((Queue_Controller::lane(str) == lowest_dropped_lane) && (kept.find(num(str)) != kept.end()))
+            {
+                EXPECT_TRUE(newest ? (num(str) < num(dropped)) : (num(str) > num(dropped)));
+            }
+        }
+    }
+}
+
 TEST(Queue_Controller_Test, DISABLED_Remove_Newest_Below_Prio)
 {
     std::minstd_rand rng;
@@ -1427,6 +2642,8 @@ TEST(Queue_Controller_Test, DISABLED_Remove_Newest_Below_Prio)
         EXPECT_EQ(v.size(), 30);
     }
 
+    std::vector<std::string> pushed;
+
     for (int i = 0; i < 30; ++i)
     {
         unsigned int r = rng();
@@ -1446,6 +2663,7 @@ TEST(Queue_Controller_Test, DISABLED_Remove_Newest_Below_Prio)
         if (r == 3)
             str = new std::string(FPL_ERROR(msg.c_str()).add("num", i).as_string());
 
+        pushed.push_back(*str);
         qc.push(str);
 
         //std::cout << *str << std::endl;
@@ -1470,33 +2688,431 @@ TEST(Queue_Controller_Test, DISABLED_Remove_Newest_Below_Prio)
         EXPECT_EQ(v.size(), 23);
     }
 
-    bool correct_found = false;
-    for (std::vector<std::string*>::iterator it(v.begin()); it != v.end(); ++it)
+    check_lane_drops(pushed, v, true);
+}
+
+TEST(Queue_Controller_Test, DISABLED_Remove_Oldest_Below_Prio)
+{
+    std::minstd_rand rng;
+    rng.seed(13);
+
+    Queue_Controller qc(3600, 3000);
+    qc.change_algo(std::make_shared<Queue_Controller::Remove_Oldest_Below_Priority>(qc, fplog::Prio::warning), Queue_Controller::Algo::Fallback_Options::Remove_Oldest);
+
+    std::string msg("Ten bytes.");
+
+    for (int i = 0; i < 30; ++i)
+    {
+        unsigned int r = rng();
+        r = r % 4;
+
+        if (r == 0)
+            qc.push(new std::string(FPL_TRACE(msg.c_str()).as_string()));
+
+        if (r == 1)
+            qc.push(new std::string(FPL_INFO(msg.c_str()).as_string()));
+
+        if (r == 2)
+            qc.push(new std::string(FPL_WARN(msg.c_str()).as_string()));
+
+        if (r == 3)
+            qc.push(new std::string(FPL_ERROR(msg.c_str()).as_string()));
+    }
+
+    std::vector<std::string*> v;
+
+    while (!qc.empty())
+    {
+        v.push_back(qc.front());
+        qc.pop();
+    }
+
+    if (v.size() != 30)
+    {
+        cout << "Incorrect size of queue detected! (" << v.size() << ")." << std::endl;
+        EXPECT_EQ(v.size(), 30);
+    }
+
+    std::vector<std::string> pushed;
+
+    for (int i = 0; i < 30; ++i)
+    {
+        unsigned int r = rng();
+        r = r % 4;
+
+        std::string* str = nullptr;
+
+        if (r == 0)
+            str = new std::string(FPL_TRACE(msg.c_str()).add("num", i).as_string());
+
+        if (r == 1)
+            str = new std::string(FPL_INFO(msg.c_str()).add("num", i).as_string());
+
+        if (r == 2)
+            str = new std::string(FPL_WARN(msg.c_str()).add("num", i).as_string());
+
+        if (r == 3)
+            str = new std::string(FPL_ERROR(msg.c_str()).add("num", i).as_string());
+
+        pushed.push_back(*str);
+        qc.push(str);
+
+        //std::cout << *str << std::endl;
+    }
+
+    std::this_thread::sleep_for(chrono::seconds(4));
+
+    //std::cout << "************************" << std::endl;
+
+    qc.push(new std::string(msg));
+    v.clear();
+
+    while (!qc.empty())
+    {
+        //std::cout << *qc.front() << std::endl;
+        v.push_back(qc.front());
+        qc.pop();
+    }
+
+    if (v.size() != 23)
+    {
+        cout << "Incorrect size of queue detected! (" << v.size() << ")." << std::endl;
+        EXPECT_EQ(v.size(), 23);
+    }
+
+    check_lane_drops(pushed, v, false);
+}
+
+TEST(Queue_Controller_Test, Priority_Lanes)
+{
+    Queue_Controller qc(20000000, 30000);
+
+    for (int i = 0; i < 1000; ++i)
+        qc.push(new std::string(fplog::Message(fplog::Prio::debug, "test", "Debug backlog.").add("num", i).as_string()));
+
+    qc.push(new std::string(fplog::Message(fplog::Prio::error, "test", "Error.").as_string()));
+
+    std::unique_ptr<std::string> str(qc.front());
+    qc.pop();
+    EXPECT_EQ(Queue_Controller::lane(*str), fplog::Prio_Level::error);
+
+    for (int i = 0; i < 100; ++i)
+        qc.push(new std::string(fplog::Message(fplog::Prio::error, "test", "Error.").as_string()));
+
+    //debug lane still gets its share while errors keep coming, in the order its messages were pushed
+    int debug_count = 0, error_count = 0;
+    while (!qc.empty())
     {
-        if ((**it).find("\"num\":26") != string::npos)
+        str.reset(qc.front());
+        qc.pop();
+
+        if (Queue_Controller::lane(*str) == fplog::Prio_Level::debug)
         {
-            cout << "Remove_Newest_Below_Priority: incorrect string detected: " << **it << std::endl;
-            EXPECT_EQ((**it).find("\"num\":26"), string::npos);
+            EXPECT_NE(str->find("\"num\":" + std::to_string(debug_count)), std::string::npos);
+            debug_count++;
         }
+        else
+        {
+            error_count++;
 
-        if ((**it).find("\"num\":2") != string::npos)
-            correct_found = true;
+            if (error_count == 100)
+            {
+                EXPECT_GT(debug_count, 0);
+            }
+        }
     }
 
-    if (!correct_found)
+    EXPECT_EQ(debug_count, 1000);
+    EXPECT_EQ(error_count, 100);
+
+    //priority given by the caller wins over the one in the payload
+    qc.push(new std::string(fplog::Message(fplog::Prio::debug, "test", "Debug.").as_string()));
+    qc.push(new std::string("Ten bytes."), fplog::Prio_Level::critical);
+
+    str.reset(qc.front());
+    qc.pop();
+    EXPECT_EQ(*str, "Ten bytes.");
+
+    str.reset(qc.front());
+    qc.pop();
+    EXPECT_TRUE(qc.empty());
+}
+
+TEST(Queue_Controller_Test, Read)
+{
+    Queue_Controller qc(20000000, 30000);
+
+    qc.push("first", 5, fplog::Prio_Level::debug);
+    qc.push("second", 6, fplog::Prio_Level::debug);
+    qc.push("info", 4, fplog::Prio_Level::info);
+    qc.push("third", 5, fplog::Prio_Level::debug);
+    qc.push(std::string(100000, 'x').c_str(), 100000, fplog::Prio_Level::debug);
+    qc.push("error", 5, fplog::Prio_Level::error);
+
+    EXPECT_EQ(qc.size(), 100025);
+
+    //error goes first and stops the read as a message that should be flushed right away
+    std::string out("[");
+    Queue_Controller::Read_Result res(qc.read(out, 1000, ',', fplog::Prio_Level::error));
+    EXPECT_EQ(res.count, 1);
+    EXPECT_TRUE(res.flush);
+    EXPECT_EQ(out, "[,error");
+
+    //message bigger than the space left stays in the queue
+    out.clear();
+    res = qc.read(out, 1000, ',', fplog::Prio_Level::error);
+    EXPECT_EQ(res.count, 4);
+    EXPECT_FALSE(res.flush);
+    EXPECT_EQ(out, ",info,first,second,third");
+    EXPECT_EQ(qc.size(), 100000);
+
+    std::unique_ptr<std::string> str(qc.front());
+    qc.pop();
+    EXPECT_EQ(str->size(), 100000);
+    EXPECT_TRUE(qc.empty());
+    EXPECT_EQ(qc.size(), 0);
+}
+
+TEST(Queue_Controller_Test, Spill_To_Disk)
+{
     {
-        cout << "Remove_Newest_Below_Priority: unable to locate expected string" << endl;
-        EXPECT_TRUE(correct_found);
+        Queue_Controller qc(1000, 0);
+
+        sprot::Params params;
+        params["emergency_algo"] = "spill_to_disk";
+        params["spill_dir"] = "/tmp";
+        params["spill_max_size"] = "100000";
+        qc.apply_config(params);
+
+        for (int i = 0; i < 300; ++i)
+        {
+            std::string str(std::to_string(i) + std::string(i % 7, '.'));
+            qc.push(str.c_str(), str.size(), (i % 3) ? fplog::Prio_Level::debug : fplog::Prio_Level::error);
+        }
+
+        EXPECT_LE(qc.size(), 1000);
+
+        //nothing is lost and messages of each priority come back in the order they were pushed
+        int count = 0, last_error = -1, last_debug = -1;
+        while (!qc.empty())
+        {
+            std::unique_ptr<std::string> str(qc.front());
+            qc.pop();
+
+            int num = std::stoi(*str);
+            int& last = (num % 3) ? last_debug : last_error;
+
+            EXPECT_GT(num, last);
+            last = num;
+            count++;
+        }
+
+        EXPECT_EQ(count, 300);
     }
+
+    //segment files are removed once they are read back
+    std::string ls("ls /tmp/fplog_spill_" + std::to_string(getpid()) + "_* > /dev/null 2>&1");
+    EXPECT_NE(system(ls.c_str()), 0);
 }
 
-TEST(Queue_Controller_Test, DISABLED_Remove_Oldest_Below_Prio)
+TEST(Queue_Controller_Test, Spill_Full)
+{
+    Queue_Controller qc(10000, 0);
+
+    sprot::Params params;
+    params["emergency_algo"] = "spill_to_disk";
+    params["spill_dir"] = "/tmp";
+    params["spill_max_size"] = "1"; //one segment
+    qc.apply_config(params);
+
+    const int count = 12000;
+
+    for (int i = 0; i < count; ++i)
+    {
+        std::string str(std::to_string(i) + std::string(500, '.'));
+        qc.push(str.c_str(), str.size(), fplog::Prio_Level::info);
+    }
+
+    unsigned long long dropped[Queue_Controller::lane_count] = {};
+    qc.collect_drops(dropped);
+
+    //what did not fit on disk is dropped instead of overtaking spilled messages
+    int received = 0, last = -1;
+    while (!qc.empty())
+    {
+        std::unique_ptr<std::string> str(qc.front());
+        qc.pop();
+
+        int num = std::stoi(*str);
+        EXPECT_GT(num, last);
+        last = num;
+        received++;
+    }
+
+    EXPECT_GT(dropped[fplog::Prio_Level::info], 0);
+    EXPECT_EQ(received + dropped[fplog::Prio_Level::info], count);
+}
+
+TEST(Queue_Controller_Test, Drop_Counters)
+{
+    Queue_Controller qc(100, 0);
+
+    sprot::Params params;
+    params["emergency_algo"] = "remove_oldest_below_prio";
+    params["emergency_prio"] = fplog::Prio::warning;
+    qc.apply_config(params);
+
+    int pushed[Queue_Controller::lane_count] = {};
+    for (int i = 0; i < 50; ++i)
+    {
+        int prio = (i % 10) ? ((i % 2) ? fplog::Prio_Level::debug : fplog::Prio_Level::info) : fplog::Prio_Level::error;
+        std::string str(std::to_string(i) + "........");
+
+        qc.push(str.c_str(), str.size(), prio);
+        pushed[prio]++;
+    }
+
+    unsigned long long dropped[Queue_Controller::lane_count] = {};
+    qc.collect_drops(dropped);
+
+    EXPECT_EQ(dropped[fplog::Prio_Level::error], 0ULL);
+    EXPECT_GT(dropped[fplog::Prio_Level::debug], 0ULL);
+
+    int kept[Queue_Controller::lane_count] = {};
+    while (!qc.empty())
+    {
+        std::unique_ptr<std::string> str(qc.front());
+        qc.pop();
+
+        int num = std::stoi(*str);
+        kept[(num % 10) ? ((num % 2) ? fplog::Prio_Level::debug : fplog::Prio_Level::info) : fplog::Prio_Level::error]++;
+    }
+
+    for (int i = 0; i < Queue_Controller::lane_count; ++i)
+    {
+        EXPECT_EQ(kept[i] + dropped[i], static_cast<unsigned long long>(pushed[i]));
+    }
+
+    //counters start over after they were collected
+    unsigned long long again[Queue_Controller::lane_count] = {};
+    qc.collect_drops(again);
+
+    for (int i = 0; i < Queue_Controller::lane_count; ++i)
+    {
+        EXPECT_EQ(again[i], 0ULL);
+    }
+}
+
+static void write_cgroup_file(const std::string& dir, const char* name, const std::string& value)
+{
+    std::ofstream file(dir + "/" + name, std::ios::trunc);
+    file << value << "\n";
+}
+
+TEST(Queue_Controller_Test, Memory_Limit)
+{
+    char dir_template[] = "/tmp/fplog2_test_cgroup_XXXXXX";
+    ASSERT_NE(mkdtemp(dir_template), nullptr);
+    std::string dir(dir_template);
+
+    write_cgroup_file(dir, "memory.max", "1000000");
+    write_cgroup_file(dir, "memory.current", "990000");
+
+    {
+        Memory_Budget memory(dir, 50);
+        size_t budget = 0;
+
+        EXPECT_TRUE(memory.budget(0, budget));
+        EXPECT_EQ(budget, 5000);
+
+        //queued bytes are already counted in memory.current
+        EXPECT_TRUE(memory.budget(2000, budget));
+        EXPECT_EQ(budget, 6000);
+
+        write_cgroup_file(dir, "memory.high", "995000");
+        EXPECT_TRUE(memory.budget(0, budget));
+        EXPECT_EQ(budget, 2500);
+        unlink((dir + "/memory.high").c_str());
+
+        write_cgroup_file(dir, "memory.max", "max");
+        EXPECT_FALSE(memory.budget(0, budget));
+        write_cgroup_file(dir, "memory.max", "1000000");
+    }
+
+    //timeout is long enough for the queue to hit its limit only under memory pressure
+    Queue_Controller qc(1000000, 60000);
+
+    sprot::Params params;
+    params["emergency_algo"] = "remove_oldest";
+    params["memory_limit_dir"] = dir;
+    params["memory_check_interval"] = "0";
+    qc.apply_config(params);
+
+    std::string str(100, '.');
+
+    for (int i = 0; i < 200; ++i)
+    {
+        write_cgroup_file(dir, "memory.current", std::to_string(990000 + qc.size()));
+        qc.push(str.c_str(), str.size(), fplog::Prio_Level::debug);
+
+        EXPECT_LE(qc.size(), 5000 + str.size());
+    }
+
+    //plenty of memory again, nothing is dropped
+    write_cgroup_file(dir, "memory.current", "100000");
+    size_t size = qc.size();
+
+    for (int i = 0; i < 200; ++i)
+        qc.push(str.c_str(), str.size(), fplog::Prio_Level::debug);
+
+    EXPECT_EQ(qc.size(), size + 200 * str.size());
+
+    //queues with the same settings share one process-wide budget instead of getting one each
+    EXPECT_EQ(Memory_Budget::shared(dir, 50), Memory_Budget::shared(dir, 50));
+    EXPECT_NE(Memory_Budget::shared(dir, 50), Memory_Budget::shared(dir, 60));
+
+    {
+        Queue_Controller first(1000000, 60000), second(1000000, 60000);
+        first.apply_config(params);
+        second.apply_config(params);
+
+        for (int i = 0; i < 200; ++i)
+        {
+            write_cgroup_file(dir, "memory.current", std::to_string(990000 + first.size() + second.size()));
+            first.push(str.c_str(), str.size(), fplog::Prio_Level::debug);
+
+            write_cgroup_file(dir, "memory.current", std::to_string(990000 + first.size() + second.size()));
+            second.push(str.c_str(), str.size(), fplog::Prio_Level::debug);
+
+            EXPECT_LE(first.size() + second.size(), 5000 + 2 * str.size());
+        }
+
+        EXPECT_GT(first.size(), 0);
+        EXPECT_GT(second.size(), 0);
+    }
+
+    unlink((dir + "/memory.max").c_str());
+    unlink((dir + "/memory.current").c_str());
+    rmdir(dir.c_str());
+}
+
+TEST(Queue_Controller_Test, DISABLED_Apply_Config)
 {
     std::minstd_rand rng;
-    rng.seed(13);
+    rng.seed(21);
 
-    Queue_Controller qc(3600, 3000);
-    qc.change_algo(std::make_shared<Queue_Controller::Remove_Oldest_Below_Priority>(qc, fplog::Prio::warning), Queue_Controller::Algo::Fallback_Options::Remove_Oldest);
+    Queue_Controller qc(1, 1);
+    qc.change_algo(std::make_shared<Queue_Controller::Remove_Newest>(qc), Queue_Controller::Algo::Fallback_Options::Remove_Newest);
+
+    sprot::Params params;
+
+    params["max_queue_size"] = "3600";
+    params["emergency_timeout"] = "3000";
+    params["emergency_algo"] = "remove_newest_below_prio";
+    params["emergency_fallback_algo"] = "remove_newest";
+    params["emergency_prio"] = std::string(fplog::Prio::warning);
+
+    qc.apply_config(params);
 
     std::string msg("Ten bytes.");
 
@@ -1532,6 +3148,8 @@ TEST(Queue_Controller_Test, DISABLED_Remove_Oldest_Below_Prio)
         EXPECT_EQ(v.size(), 30);
     }
 
+    std::vector<std::string> pushed;
+
     for (int i = 0; i < 30; ++i)
     {
         unsigned int r = rng();
@@ -1551,6 +3169,7 @@ TEST(Queue_Controller_Test, DISABLED_Remove_Oldest_Below_Prio)
         if (r == 3)
             str = new std::string(FPL_ERROR(msg.c_str()).add("num", i).as_string());
 
+        pushed.push_back(*str);
         qc.push(str);
 
         //std::cout << *str << std::endl;
@@ -1576,148 +3195,516 @@ TEST(Queue_Controller_Test, DISABLED_Remove_Oldest_Below_Prio)
         EXPECT_EQ(v.size(), 23);
     }
 
-    bool correct_found = false;
-    for (std::vector<std::string*>::iterator it(v.begin()); it != v.end(); ++it)
+    check_lane_drops(pushed, v, true);
+}
+
+
+static void run_write_scaling(bool thread_queues, unsigned int thread_count, unsigned int messages_per_thread)
+{
+    sprot::Params params;
+    params["thread_queues"] = thread_queues ? "true" : "false";
+    fplog::change_config(params);
+
+    std::vector<std::thread> threads;
+    std::vector<std::vector<unsigned long long>> latencies(thread_count);
+    std::atomic<unsigned int> ready(0);
+    std::atomic<bool> go(false);
+
+    for (unsigned int t = 0; t < thread_count; ++t)
     {
-        if ((**it).find("\"num\":4") != string::npos)
+        threads.push_back(std::thread([&, t]()
         {
-            cout << "Remove_Oldest_Below_Priority: incorrect string detected: " << **it << std::endl;
-            EXPECT_EQ((**it).find("\"num\":4"), string::npos);
-        }
+            fplog::Priority_Filter* filter = new fplog::Priority_Filter("bench_prio");
+            filter->add_all_above(fplog::Prio::debug, true);
+            fplog::openlog(fplog::Facility::user, filter);
 
-        if ((**it).find("\"num\":29") != string::npos)
-            correct_found = true;
-    }
+            latencies[t].reserve(messages_per_thread);
+            fplog::Message msg(fplog::Prio::info, fplog::Facility::user, "scaling benchmark message from thread %d", t);
 
-    if (!correct_found)
-    {
-        cout << "Remove_Oldest_Below_Priority: unable to locate expected string" << endl;
-        EXPECT_TRUE(correct_found);
+            ready++;
+            while (!go)
+                std::this_thread::yield();
+
+            for (unsigned int i = 0; i < messages_per_thread; ++i)
+            {
+                auto start = std::chrono::steady_clock::now();
+                fplog::write(msg);
+                latencies[t].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+            }
+
+            fplog::closelog();
+        }));
     }
+
+    while (ready < thread_count)
+        std::this_thread::yield();
+
+    auto start = std::chrono::steady_clock::now();
+    go = true;
+
+    for (auto& thread : threads)
+        thread.join();
+
+    auto elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<unsigned long long> all;
+    for (auto& v : latencies)
+        all.insert(all.end(), v.begin(), v.end());
+
+    std::sort(all.begin(), all.end());
+
+    unsigned long long total = static_cast<unsigned long long>(thread_count) * messages_per_thread;
+
+    cout << (thread_queues ? "thread queues " : "shared queue  ") << "threads = " << thread_count
+         << ", msg/s = " << (elapsed_us ? total * 1000000 / elapsed_us : 0)
+         << ", p50 = " << all[all.size() / 2] << " ns"
+         << ", p99 = " << all[all.size() * 99 / 100] << " ns" << endl;
+
+    fplog::g_fplog_impl.load()->wait_until_queues_are_empty();
 }
 
-TEST(Queue_Controller_Test, DISABLED_Apply_Config)
+//Compares producer throughput and write() latency of the shared queue (one lock for all threads)
+//with per-thread queues.
+TEST(Fplog_Perf_Test, DISABLED_Thread_Queues_Scaling)
 {
-    std::minstd_rand rng;
-    rng.seed(21);
+    fplog::initlog("fplog_bench", &g_null_transport, true);
+    fplog::g_fplog_impl.load()->set_test_mode(false);
 
-    Queue_Controller qc(1, 1);
-    qc.change_algo(std::make_shared<Queue_Controller::Remove_Newest>(qc), Queue_Controller::Algo::Fallback_Options::Remove_Newest);
+    for (unsigned int threads = 1; threads <= 64; threads *= 2)
+    {
+        run_write_scaling(false, threads, 2000);
+        run_write_scaling(true, threads, 2000);
+    }
 
     sprot::Params params;
+    params["thread_queues"] = "false";
+    fplog::change_config(params);
 
-    params["max_queue_size"] = "3600";
-    params["emergency_timeout"] = "3000";
-    params["emergency_algo"] = "remove_newest_below_prio";
-    params["emergency_fallback_algo"] = "remove_newest";
-    params["emergency_prio"] = std::string(fplog::Prio::warning);
+    try
+    {
+        fplog::initlog("fplog_test", nullptr, false);
+    }
+    catch (fplog::exceptions::Transport_Missing&)
+    {
+    }
 
-    qc.apply_config(params);
+    fplog::g_fplog_impl.load()->set_test_mode(true);
 
-    std::string msg("Ten bytes.");
+    EXPECT_GT(g_null_transport.written_, 0);
+}
 
-    for (int i = 0; i < 30; ++i)
+//Sends messages through a real protocol session to a receiver on localhost and counts them on the receiving side.
+static void run_batching_benchmark(const char* batch_size, bool adaptive, unsigned short port, unsigned int messages)
+{
+    const std::string marker("batching benchmark message");
+
+    sprot::Session_Manager mgr;
+    sprot::Params params;
+
+    params["chaos"] = "0";
+    params["ip"] = "127.0.0.1";
+    params["port"] = std::to_string(port);
+
+    std::atomic<unsigned int> received(0);
+
+    std::thread receiver([&]()
     {
-        unsigned int r = rng();
-        r = r % 4;
+        sprot::Address remote;
+        remote.ip = 0x0100007f;
+        remote.port = port + 1;
 
-        if (r == 0)
-            qc.push(new std::string(FPL_TRACE(msg.c_str()).as_string()));
+        std::unique_ptr<sprot::Session> session(mgr.accept(params, remote, 15000));
+        if (!session)
+            return;
 
-        if (r == 1)
-            qc.push(new std::string(FPL_INFO(msg.c_str()).as_string()));
+        std::vector<char> buf(1024 * 1024);
+        std::string tail;
 
-        if (r == 2)
-            qc.push(new std::string(FPL_WARN(msg.c_str()).as_string()));
+        while (received < messages)
+        {
+            size_t read_bytes = 0;
 
-        if (r == 3)
-            qc.push(new std::string(FPL_ERROR(msg.c_str()).as_string()));
-    }
+            try
+            {
+                read_bytes = session->read(buf.data(), buf.size(), 5000);
+            }
+            catch (fplog::exceptions::Generic_Exception&)
+            {
+                break;
+            }
 
-    std::vector<std::string*> v;
+            if (!read_bytes)
+                break;
 
-    while (!qc.empty())
+            //marker could be split between two reads, that is why the tail of the previous read is kept
+            std::string data(tail + std::string(buf.data(), read_bytes));
+            for (size_t pos = data.find(marker); pos != std::string::npos; pos = data.find(marker, pos + marker.size()))
+                received++;
+
+            tail = data.substr(data.size() > marker.size() ? data.size() - marker.size() + 1 : 0);
+        }
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    sprot::Params sender_params(params);
+    sender_params["port"] = std::to_string(port + 1);
+
+    sprot::Address remote;
+    remote.ip = 0x0100007f;
+    remote.port = port;
+
+    std::unique_ptr<sprot::Session> session(mgr.connect(sender_params, remote, 15000));
+    if (!session)
     {
-        v.push_back(qc.front());
-        qc.pop();
+        receiver.join();
+        EXPECT_NE(session, nullptr);
+        return;
     }
 
-    if (v.size() != 30)
+    fplog::initlog("fplog_bench", session.get(), true);
+    fplog::g_fplog_impl.load()->set_test_mode(false);
+
+    sprot::Params config;
+    config["batch_size"] = batch_size;
+    config["batch_latency"] = "5";
+    config["batch_adaptive"] = adaptive ? "true" : "false";
+    fplog::change_config(config);
+
+    fplog::Priority_Filter* filter = new fplog::Priority_Filter("bench_prio");
+    filter->add_all_above(fplog::Prio::debug, true);
+    fplog::openlog(fplog::Facility::user, filter);
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned int i = 0; i < messages; ++i)
+        fplog::write(FPL_INFO("batching benchmark message %d", i));
+
+    receiver.join();
+
+    auto elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    cout << "batch_size = " << batch_size << (adaptive ? " adaptive" : " fixed") << ", received " << received << " of " << messages
+         << ", msg/s = " << (elapsed_us ? static_cast<unsigned long long>(received) * 1000000 / elapsed_us : 0) << endl;
+
+    fplog::closelog();
+    fplog::g_fplog_impl.load()->wait_until_queues_are_empty();
+
+    //session is about to go away, mq_reader must not use it anymore
+    fplog::initlog("fplog_bench", &g_null_transport, true);
+
+    config["batch_size"] = "0";
+    config["batch_adaptive"] = "true";
+    fplog::change_config(config);
+
+    EXPECT_EQ(received, messages);
+}
+
+//Messages per second delivered to a local receiver with every message in its own frame,
+//with fixed batches up to the MTU and with adaptive batches that wait only while the queue is busy.
+TEST(Fplog_Perf_Test, DISABLED_Batching_Throughput)
+{
+    run_batching_benchmark("0", true, 26370, 20000);
+    run_batching_benchmark("mtu", false, 26372, 20000);
+    run_batching_benchmark("mtu", true, 26374, 20000);
+
+    try
+    {
+        fplog::initlog("fplog_test", nullptr, false);
+    }
+    catch (fplog::exceptions::Transport_Missing&)
     {
-        cout << "Incorrect size of queue detected! (" << v.size() << ")." << std::endl;
-        EXPECT_EQ(v.size(), 30);
     }
 
-    for (int i = 0; i < 30; ++i)
+    fplog::g_fplog_impl.load()->set_test_mode(true);
+}
+
+class Timestamp_Transport: public sprot::Basic_Transport_Interface
+{
+    public:
+
+        size_t read(void*, size_t, size_t = infinite_wait){ return 0; }
+
+        size_t write(const void*, size_t buf_size, size_t = infinite_wait)
+        {
+            written_at_ = std::chrono::steady_clock::now().time_since_epoch().count();
+            written_++;
+            return buf_size;
+        }
+
+        std::atomic<long long> written_at_{0};
+        std::atomic<unsigned long long> written_{0};
+};
+
+//Time from write() to the transport for the first message after a quiet period, mq_reader is asleep every time.
+TEST(Fplog_Perf_Test, DISABLED_First_Message_Latency)
+{
+    Timestamp_Transport transport;
+
+    fplog::initlog("fplog_bench", &transport, true);
+    fplog::g_fplog_impl.load()->set_test_mode(false);
+
+    fplog::Priority_Filter* filter = new fplog::Priority_Filter("bench_prio");
+    filter->add_all_above(fplog::Prio::debug, true);
+    fplog::openlog(fplog::Facility::user, filter);
+
+    std::vector<long long> latencies;
+
+    for (int i = 0; i < 200; ++i)
     {
-        unsigned int r = rng();
-        r = r % 4;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
 
-        std::string* str = nullptr;
+        unsigned long long written = transport.written_;
+        long long start = std::chrono::steady_clock::now().time_since_epoch().count();
 
-        if (r == 0)
-            str = new std::string(FPL_TRACE(msg.c_str()).add("num", i).as_string());
+        fplog::write(FPL_INFO("first message after a quiet period %d", i));
 
-        if (r == 1)
-            str = new std::string(FPL_INFO(msg.c_str()).add("num", i).as_string());
+        while (transport.written_ == written)
+            std::this_thread::yield();
 
-        if (r == 2)
-            str = new std::string(FPL_WARN(msg.c_str()).add("num", i).as_string());
+        latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::duration(transport.written_at_ - start)).count());
+    }
 
-        if (r == 3)
-            str = new std::string(FPL_ERROR(msg.c_str()).add("num", i).as_string());
+    std::sort(latencies.begin(), latencies.end());
 
-        qc.push(str);
+    cout << "first message latency p50 = " << latencies[latencies.size() / 2] << " us"
+         << ", p99 = " << latencies[latencies.size() * 99 / 100] << " us" << endl;
 
-        //std::cout << *str << std::endl;
+    fplog::closelog();
+    fplog::g_fplog_impl.load()->wait_until_queues_are_empty();
+
+    //transport is about to go away, mq_reader must not use it anymore
+    fplog::initlog("fplog_bench", &g_null_transport, true);
+
+    try
+    {
+        fplog::initlog("fplog_test", nullptr, false);
+    }
+    catch (fplog::exceptions::Transport_Missing&)
+    {
     }
 
-    std::this_thread::sleep_for(chrono::seconds(4));
+    fplog::g_fplog_impl.load()->set_test_mode(true);
 
-    //std::cout << "************************" << std::endl;
+    EXPECT_EQ(transport.written_, 200);
+}
 
-    qc.push(new std::string(msg));
-    v.clear();
+TEST(Fplog_Perf_Test, DISABLED_Filtered_Out_Cost)
+{
+    fplog::openlog(fplog::Facility::user, new fplog::Priority_Filter("bench_prio"));
 
-    while (!qc.empty())
+    fplog::Priority_Filter* filter = dynamic_cast<fplog::Priority_Filter*>(fplog::find_filter("bench_prio"));
+    filter->add(fplog::Prio::error);
+
+    const unsigned int count = 200000;
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < count; ++i)
+        fplog::write(FPL_TRACE("filtered out trace %d", i).add("index", static_cast<int>(i)));
+    auto gated_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < count / 100; ++i)
+        fplog::write(fplog::Message(fplog::Prio::debug, fplog::Facility::user, "filtered out trace %d", i).add("index", static_cast<int>(i)));
+    auto built_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    cout << "gated FPL_TRACE = " << gated_ns / count << " ns, fully built message = " << built_ns / (count / 100) << " ns" << endl;
+
+    fplog::closelog();
+
+    EXPECT_LT(gated_ns / count, built_ns / (count / 100));
+}
+
+//Cost of a single Priority_Filter::should_pass() for messages with a known priority (one AND)
+//and for messages with a custom priority string that still goes through a string lookup.
+TEST(Fplog_Perf_Test, DISABLED_Priority_Filter_Cost)
+{
+    fplog::Priority_Filter filter("bench_prio");
+    filter.add_all_above(fplog::Prio::warning, true);
+    filter.add("custom");
+
+    fplog::Message known(fplog::Prio_Level::error, fplog::Facility::user, "known priority");
+    fplog::Message custom(fplog::Message(std::string("{\"priority\":\"custom\",\"facility\":\"user\"}")));
+
+    const unsigned int count = 10000000;
+    unsigned int passed = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < count; ++i)
+        passed += filter.should_pass(known);
+    auto known_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < count; ++i)
+        passed += filter.should_pass(custom);
+    auto custom_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    cout << "should_pass: known priority = " << static_cast<double>(known_ns) / count << " ns, custom priority = "
+         << static_cast<double>(custom_ns) / count << " ns" << endl;
+
+    EXPECT_EQ(passed, count * 2);
+}
+
+#ifdef __GLIBC__
+//Counts heap allocations of the whole test binary while g_count_allocations is set.
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+
+static std::atomic<bool> g_count_allocations(false);
+static std::atomic<unsigned long long> g_allocations(0);
+static std::atomic<unsigned long long> g_allocated_bytes(0);
+
+static void count_allocation(size_t size)
+{
+    if (!g_count_allocations.load(std::memory_order_relaxed))
+        return;
+
+    g_allocations++;
+    g_allocated_bytes += size;
+}
+
+extern "C" void* malloc(size_t size) noexcept { count_allocation(size); return __libc_malloc(size); }
+extern "C" void* calloc(size_t count, size_t size) noexcept { count_allocation(count * size); return __libc_calloc(count, size); }
+extern "C" void* realloc(void* ptr, size_t size) noexcept { count_allocation(size); return __libc_realloc(ptr, size); }
+
+struct Allocation_Counter
+{
+    Allocation_Counter(): allocations(g_allocations), bytes(g_allocated_bytes) { g_count_allocations = true; }
+    ~Allocation_Counter() { g_count_allocations = false; }
+
+    unsigned long long allocations_since() const { return g_allocations - allocations; }
+    unsigned long long bytes_since() const { return g_allocated_bytes - bytes; }
+
+    unsigned long long allocations;
+    unsigned long long bytes;
+};
+
+//Heap allocations and bytes per message: a plain rapidjson::Document holding a typical log record
+//and copied once, the way Message used to hold it, against a Message built by FPL_INFO and copied the way write() does.
+TEST(Fplog_Perf_Test, DISABLED_Message_Allocations)
+{
+    const unsigned int count = 10000;
+
+    for (unsigned int i = 0; i < 16; ++i)
     {
-        //std::cout << *qc.front() << std::endl;
-        v.push_back(qc.front());
-        qc.pop();
+        fplog::Message warm_up(FPL_INFO("request %d served in %f ms", i, 1.5));
+        fplog::Message warm_up_copy(warm_up);
     }
 
-    if (v.size() != 23)
+    unsigned long long document_allocations = 0, document_bytes = 0;
+
     {
-        cout << "Incorrect size of queue detected! (" << v.size() << ")." << std::endl;
-        EXPECT_EQ(v.size(), 23);
+        Allocation_Counter counter;
+
+        for (unsigned int i = 0; i < count; ++i)
+        {
+            rapidjson::Document doc;
+            doc.SetObject();
+            doc.AddMember("priority", rapidjson::Value("info", doc.GetAllocator()), doc.GetAllocator());
+            doc.AddMember("facility", rapidjson::Value("user", doc.GetAllocator()), doc.GetAllocator());
+            doc.AddMember("timestamp", rapidjson::Value("2020-01-01T00:00:00.000+0000", doc.GetAllocator()), doc.GetAllocator());
+            doc.AddMember("text", rapidjson::Value("request 1 served in 1.500000 ms", doc.GetAllocator()), doc.GetAllocator());
+            doc.AddMember("module", rapidjson::Value("main.cpp", doc.GetAllocator()), doc.GetAllocator());
+            doc.AddMember("line", 1, doc.GetAllocator());
+            doc.AddMember("method", rapidjson::Value("TestBody", doc.GetAllocator()), doc.GetAllocator());
+
+            rapidjson::Document copy;
+            copy.CopyFrom(doc, copy.GetAllocator());
+        }
+
+        document_allocations = counter.allocations_since();
+        document_bytes = counter.bytes_since();
     }
 
-    bool correct_found = false;
-    for (std::vector<std::string*>::iterator it(v.begin()); it != v.end(); ++it)
+    unsigned long long message_allocations = 0, message_bytes = 0;
+
     {
-        if ((**it).find("\"num\":26") != string::npos)
+        Allocation_Counter counter;
+
+        for (unsigned int i = 0; i < count; ++i)
         {
-            cout << "Remove_Newest_Below_Priority: incorrect string detected: " << **it << std::endl;
-            EXPECT_EQ((**it).find("\"num\":26"), string::npos);
+            fplog::Message msg(FPL_INFO("request %d served in %f ms", i, 1.5));
+            fplog::Message copy(msg);
         }
 
-        if ((**it).find("\"num\":2") != string::npos)
-            correct_found = true;
+        message_allocations = counter.allocations_since();
+        message_bytes = counter.bytes_since();
     }
 
-    if (!correct_found)
+    cout << "rapidjson::Document: allocations/msg = " << static_cast<double>(document_allocations) / count
+         << ", bytes/msg = " << document_bytes / count << endl;
+    cout << "fplog::Message:      allocations/msg = " << static_cast<double>(message_allocations) / count
+         << ", bytes/msg = " << message_bytes / count << endl;
+
+    EXPECT_LT(message_bytes, document_bytes);
+}
+
+//Moving a message must not copy its document and serializing it must allocate only the resulting string.
+TEST(Fplog_Api_Test, Move_And_Serialize_Allocations)
+{
     {
-        cout << "Remove_Newest_Below_Priority: unable to locate expected string" << endl;
-        EXPECT_TRUE(correct_found);
+        fplog::Message warm_up(FPL_INFO("warm up %d", 0));
+        fplog::Message warm_up_copy(warm_up);
+    }
+
+    fplog::Message msg(FPL_INFO("moved around %d", 1));
+    std::string expected(msg.as_string());
+
+    {
+        Allocation_Counter counter;
+
+        fplog::Message moved(std::move(msg));
+        msg = std::move(moved);
+        std::string str(msg.as_string());
+
+        EXPECT_EQ(counter.allocations_since(), 1);
+        EXPECT_EQ(str, expected);
     }
 }
 
+//Time and heap allocations per FPL_INFO on the calling thread: text formatted right away with vsnprintf
+//against deferred formatting, which only captures the arguments into the memory pool of the message.
+TEST(Fplog_Perf_Test, DISABLED_Deferred_Capture_Cost)
+{
+    const unsigned int count = 200000;
+    const char* path = "/var/lib/service/data.bin";
+
+    auto measure = [&](bool deferred, unsigned long long& allocations)
+    {
+        fplog::change_config({{"deferred_formatting", deferred ? "true" : "false"}});
+
+        for (unsigned int i = 0; i < 16; ++i)
+            fplog::Message warm_up(FPL_INFO("request %d for %s served in %f ms, %llu bytes", i, path, 1.5, 4096ULL));
+
+        Allocation_Counter counter;
+
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < count; ++i)
+            fplog::Message msg(FPL_INFO("request %d for %s served in %f ms, %llu bytes", i, path, 1.5, 4096ULL));
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+        allocations = counter.allocations_since();
+        return ns;
+    };
+
+    unsigned long long formatted_allocations = 0, deferred_allocations = 0;
+
+    auto formatted_ns = measure(false, formatted_allocations);
+    auto deferred_ns = measure(true, deferred_allocations);
+
+    fplog::change_config({{"deferred_formatting", "false"}});
+
+    cout << "vsnprintf: " << formatted_ns / count << " ns, allocations/msg = " << static_cast<double>(formatted_allocations) / count << endl;
+    cout << "deferred:  " << deferred_ns / count << " ns, allocations/msg = " << static_cast<double>(deferred_allocations) / count << endl;
+
+    EXPECT_LT(deferred_ns, formatted_ns);
+    EXPECT_LE(deferred_allocations, formatted_allocations);
+}
+#endif
 
 int main(int argc, char **argv)
 {
-    system("rm /tmp/fplog2_sequence_stop");
-    //system("./shared_sequence.sh&");
-
     debug_logging::g_logger.open("fplog2-test-log.txt");
 
     /*sprot::Session_Manager mgr;
@@ -1791,7 +3778,7 @@ int main(int argc, char **argv)
     {
     }
 
-    fplog::g_fplog_impl->set_test_mode(true);
+    fplog::g_fplog_impl.load()->set_test_mode(true);
 
     ::testing::InitGoogleTest(&argc, argv);
 
@@ -1802,9 +3789,5 @@ int main(int argc, char **argv)
     //stop = true;
     //reader1.join();
 
-    system("touch /tmp/fplog2_sequence_stop");
-    sequence_number::read_sequence_number(1000);
-    system("rm /tmp/fplog2_sequence_stop");
-
     return res;
 }
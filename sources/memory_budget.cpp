@@ -0,0 +1,124 @@
+#include <memory_budget.h>
+#include <fstream>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <unistd.h>
+
+Memory_Budget::Memory_Budget(const std::string& cgroup_dir, unsigned int share):
+dir_(cgroup_dir == "auto" ? own_cgroup_dir() : cgroup_dir),
+share_(std::min(share, 100u))
+{
+}
+
+std::shared_ptr<Memory_Budget> Memory_Budget::shared(const std::string& cgroup_dir, unsigned int share)
+{
+    static std::mutex mutex;
+    static std::map<std::pair<std::string, unsigned int>, std::weak_ptr<Memory_Budget>> instances;
+
+    std::shared_ptr<Memory_Budget> created(std::make_shared<Memory_Budget>(cgroup_dir, share));
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::weak_ptr<Memory_Budget>& instance(instances[std::make_pair(created->dir_, created->share_)]);
+    std::shared_ptr<Memory_Budget> existing(instance.lock());
+    if (existing)
+        return existing;
+
+    instance = created;
+    return created;
+}
+
+bool Memory_Budget::queue_budget(size_t queued, size_t& reported, size_t& out)
+{
+    //difference wraps around when the queue shrank, adding it still gives the right sum
+    size_t change = queued - reported;
+    size_t total = queued_.fetch_add(change, std::memory_order_relaxed) + change;
+    reported = queued;
+
+    size_t all = 0;
+    if (!budget(total, all))
+        return false;
+
+    size_t others = (total > queued) ? total - queued : 0;
+    out = (all > others) ? all - others : 0;
+
+    return true;
+}
+
+void Memory_Budget::release(size_t& reported)
+{
+    queued_.fetch_sub(reported, std::memory_order_relaxed);
+    reported = 0;
+}
+
+bool Memory_Budget::budget(size_t queued, size_t& out) const
+{
+    if (dir_.empty())
+        return false;
+
+    unsigned long long limit = 0, high = 0, usage = 0;
+
+    bool has_max = read_value(dir_ + "/memory.max", limit);
+    bool has_high = read_value(dir_ + "/memory.high", high);
+
+    if (!has_max && !has_high)
+        return false;
+
+    if (!has_max || (has_high && (high < limit)))
+        limit = high;
+
+    if (!read_value(dir_ + "/memory.current", usage) && !process_rss(usage))
+        return false;
+
+    unsigned long long available = ((usage < limit) ? limit - usage : 0) + queued;
+    out = static_cast<size_t>(available / 100 * share_ + available % 100 * share_ / 100);
+
+    return true;
+}
+
+bool Memory_Budget::read_value(const std::string& path, unsigned long long& out)
+{
+    std::ifstream file(path);
+    std::string value;
+
+    if (!(file >> value) || (value == "max"))
+        return false;
+
+    try
+    {
+        size_t end = 0;
+        out = std::stoull(value, &end);
+        return end == value.size();
+    }
+    catch (std::exception&)
+    {
+        return false;
+    }
+}
+
+bool Memory_Budget::process_rss(unsigned long long& out)
+{
+    std::ifstream statm("/proc/self/statm");
+    unsigned long long total = 0, resident = 0;
+
+    if (!(statm >> total >> resident))
+        return false;
+
+    long page = sysconf(_SC_PAGESIZE);
+    out = resident * static_cast<unsigned long long>(page > 0 ? page : 4096);
+
+    return true;
+}
+
+std::string Memory_Budget::own_cgroup_dir()
+{
+    //unified hierarchy is the line "0::/path" of /proc/self/cgroup
+    std::ifstream cgroup("/proc/self/cgroup");
+    std::string line;
+
+    while (std::getline(cgroup, line))
+        if (line.compare(0, 3, "0::") == 0)
+            return "/sys/fs/cgroup" + ((line.size() > 4) ? line.substr(3) : std::string());
+
+    return std::string();
+}
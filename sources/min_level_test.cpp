@@ -0,0 +1,25 @@
+//Built with FPLOG_MIN_LEVEL above debug (see CMakeLists.txt), so that FPL_* macros below the minimum are compiled out here
+//while the rest of the tests keep the default.
+#include <gtest/gtest.h>
+#include <fplog.h>
+
+#if FPLOG_MIN_LEVEL != FPLOG_LEVEL_WARNING
+#error "min_level_test.cpp must be built with -DFPLOG_MIN_LEVEL=FPLOG_LEVEL_WARNING"
+#endif
+
+TEST(Fplog_Min_Level_Test, Compiled_Out_Arguments)
+{
+    int evaluated = 0;
+
+    fplog::write(FPL_TRACE("compiled out %d", ++evaluated));
+    fplog::write(FPL_INFO("compiled out %d", ++evaluated));
+    EXPECT_EQ(evaluated, 0);
+
+    EXPECT_EQ(FPL_INFO("compiled out %d", ++evaluated).as_string(), "{}");
+    EXPECT_EQ(evaluated, 0);
+
+    //levels at or above the minimum are still built, the calling thread has no filters so its level gate is open
+    std::string warning(FPL_WARN("compiled in %d", ++evaluated).as_string());
+    EXPECT_EQ(evaluated, 1);
+    EXPECT_NE(warning.find("compiled in 1"), std::string::npos);
+}
@@ -0,0 +1,163 @@
+#include <persistent_ring.h>
+#include <algorithm>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static_assert(std::atomic<unsigned long long>::is_always_lock_free, "persistent ring requires lock-free 64-bit atomics");
+
+Persistent_Ring::Persistent_Ring(const std::string& path, size_t capacity)
+{
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd_ == -1)
+        return;
+
+    if (flock(fd_, LOCK_EX | LOCK_NB) == -1)
+    {
+        close(fd_);
+        fd_ = -1;
+        return;
+    }
+
+    unsigned long long existing[2] = { 0, 0 }; //magic and capacity, as they start the file header
+
+    struct stat st;
+    bool valid = (fstat(fd_, &st) == 0) && (pread(fd_, existing, sizeof(existing), 0) == static_cast<ssize_t>(sizeof(existing))) &&
+                 (existing[0] == file_magic) && (existing[1] > 0) &&
+                 (static_cast<unsigned long long>(st.st_size) == data_offset + existing[1]);
+
+    capacity_ = valid ? static_cast<size_t>(existing[1]) : std::max<size_t>(capacity, data_offset);
+    map_size_ = data_offset + capacity_;
+
+    //file is filled with zeroes when it grows, so the magic only shows up once header is complete
+    if (!valid && ((ftruncate(fd_, 0) == -1) || (ftruncate(fd_, static_cast<off_t>(map_size_)) == -1)))
+        return;
+
+    void* addr = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (addr == MAP_FAILED)
+        return;
+
+    header_ = static_cast<File_Header*>(addr);
+    data_ = static_cast<char*>(addr) + data_offset;
+
+    if (!valid)
+    {
+        header_->capacity = capacity_;
+        header_->head.store(0, std::memory_order_relaxed);
+        header_->tail.store(0, std::memory_order_relaxed);
+        header_->magic = file_magic;
+    }
+
+    recover();
+}
+
+Persistent_Ring::~Persistent_Ring()
+{
+    if (header_)
+        munmap(header_, map_size_);
+
+    if (fd_ != -1)
+        close(fd_);
+}
+
+//Counts records left from the previous run, anything after the last complete record is cut off.
+void Persistent_Ring::recover()
+{
+    unsigned long long head = header_->head.load(std::memory_order_relaxed);
+    unsigned long long tail = header_->tail.load(std::memory_order_relaxed);
+
+    if ((head > tail) || (tail - head > capacity_))
+    {
+        head = tail = 0;
+        header_->head.store(0, std::memory_order_relaxed);
+    }
+
+    unsigned long long pos = head;
+    while (tail - pos >= sizeof(Record_Header))
+    {
+        Record_Header record;
+        copy_out(pos, reinterpret_cast<char*>(&record), sizeof(record));
+
+        if ((record.magic != record_magic) || (record.size > tail - pos - sizeof(record)))
+            break;
+
+        pos += sizeof(record) + record.size;
+        recovered_++;
+    }
+
+    header_->tail.store(pos, std::memory_order_release);
+    read_pos_ = head;
+}
+
+bool Persistent_Ring::push(const char* data, size_t size)
+{
+    if (!is_open())
+        return false;
+
+    unsigned long long head = header_->head.load(std::memory_order_relaxed);
+    unsigned long long tail = header_->tail.load(std::memory_order_relaxed);
+
+    if (sizeof(Record_Header) + size > capacity_ - (tail - head))
+        return false;
+
+    Record_Header record;
+    record.magic = record_magic;
+    record.size = static_cast<unsigned int>(size);
+
+    copy_in(tail, reinterpret_cast<const char*>(&record), sizeof(record));
+    copy_in(tail + sizeof(record), data, size);
+
+    header_->tail.store(tail + sizeof(record) + size, std::memory_order_release);
+    return true;
+}
+
+bool Persistent_Ring::read(std::string& out)
+{
+    if (!has_unread())
+        return false;
+
+    Record_Header record;
+    copy_out(read_pos_, reinterpret_cast<char*>(&record), sizeof(record));
+
+    out.resize(record.size);
+    if (record.size)
+        copy_out(read_pos_ + sizeof(record), &out[0], record.size);
+
+    read_pos_ += sizeof(record) + record.size;
+    read_ends_.push_back(read_pos_);
+
+    return true;
+}
+
+void Persistent_Ring::commit(size_t count)
+{
+    count = std::min(count, read_ends_.size());
+    if (!count)
+        return;
+
+    unsigned long long head = read_ends_[count - 1];
+    read_ends_.erase(read_ends_.begin(), read_ends_.begin() + count);
+
+    header_->head.store(head, std::memory_order_release);
+}
+
+void Persistent_Ring::copy_in(unsigned long long pos, const char* data, size_t size)
+{
+    size_t offset = static_cast<size_t>(pos % capacity_);
+    size_t first = std::min(size, capacity_ - offset);
+
+    memcpy(data_ + offset, data, first);
+    memcpy(data_, data + first, size - first);
+}
+
+void Persistent_Ring::copy_out(unsigned long long pos, char* data, size_t size) const
+{
+    size_t offset = static_cast<size_t>(pos % capacity_);
+    size_t first = std::min(size, capacity_ - offset);
+
+    memcpy(data, data_ + offset, first);
+    memcpy(data + first, data_, size - first);
+}
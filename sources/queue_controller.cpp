@@ -8,11 +8,12 @@
 
 #include <fplog.h>
 #include <utils.h>
-
-static const size_t buf_sz = -1;
+#include <spill_store.h>
+#include <memory_budget.h>
 
 Queue_Controller::Queue_Controller(size_t size_limit, size_t timeout):
 max_size_(size_limit),
+configured_max_size_(size_limit),
 emergency_time_trigger_(timeout),
 timer_start_(chrono::milliseconds(0))
 {
@@ -23,59 +24,329 @@ timer_start_(chrono::milliseconds(0))
     //however other algos could fail to remove items if conditions of removal are not fully met.
 }
 
+Queue_Controller::~Queue_Controller()
+{
+    if (memory_)
+        memory_->release(memory_reported_);
+}
+
+//Share of front() picks each lane gets while other lanes are not empty, from emergency down to debug,
+//messages without priority are served like notice.
+static const int lane_weights[Queue_Controller::lane_count] = { 64, 32, 16, 8, 4, 2, 1, 1, 2 };
+
+int Queue_Controller::lane(const string& str)
+{
+    static const string key(string("\"") + fplog::Message::Mandatory_Fields::priority + "\":\"");
+    static const char* prios[] = { fplog::Prio::emergency, fplog::Prio::alert, fplog::Prio::critical, fplog::Prio::error,
+                                   fplog::Prio::warning, fplog::Prio::notice, fplog::Prio::info, fplog::Prio::debug };
+
+    size_t pos = str.find(key);
+    if (pos == string::npos)
+        return unknown_lane;
+
+    pos += key.size();
+    size_t end = str.find('"', pos);
+    if (end == string::npos)
+        return unknown_lane;
+
+    for (int level = 0; level < unknown_lane; ++level)
+        if (str.compare(pos, end - pos, prios[level]) == 0)
+            return level;
+
+    return unknown_lane;
+}
+
 bool Queue_Controller::empty()
 {
-   return mq_.empty();
+    for (std::deque<Entry>& lane : lanes_)
+        if (!lane.empty())
+            return false;
+
+    return !spill_ || spill_->empty();
+}
+
+//Smooth weighted round-robin: every non-empty lane earns its weight, the richest one is served and pays the sum of weights.
+//Selection is only committed by pop(), so front() could be called any number of times.
+int Queue_Controller::select_lane()
+{
+    if ((selected_ >= 0) && !lanes_[selected_].empty())
+        return selected_;
+
+    selected_ = -1;
+
+    for (int i = 0; i < lane_count; ++i)
+    {
+        if (lanes_[i].empty())
+            continue;
+
+        if ((selected_ < 0) || (credit_[i] + lane_weights[i] > credit_[selected_] + lane_weights[selected_]))
+            selected_ = i;
+    }
+
+    return selected_;
+}
+
+void Queue_Controller::charge(int lane)
+{
+    int total = 0;
+    for (int i = 0; i < lane_count; ++i)
+    {
+        if (lanes_[i].empty())
+            continue;
+
+        credit_[i] += lane_weights[i];
+        total += lane_weights[i];
+    }
+
+    credit_[lane] -= total;
+}
+
+const char* Queue_Controller::front_data(int lane)
+{
+    Slab& slab = slabs_[lane].front();
+    return slab.data.get() + slab.begin + sizeof(Length_Header);
 }
 
 string *Queue_Controller::front()
 {
-    return mq_.front();
+    refill();
+
+    int lane = select_lane();
+    if (lane < 0)
+        return nullptr;
+
+    return new string(front_data(lane), lanes_[lane].front().size);
 }
 
 void Queue_Controller::pop()
 {
-    string* str = mq_.front();
-    
-    mq_.pop();
+    if (select_lane() < 0)
+        refill();
 
-    if (!str)
+    int lane = select_lane();
+    if (lane < 0)
         return;
 
-    #ifdef __linux__
-    int buf_length = static_cast<int>(strnlen(str->c_str(), buf_sz));
-    #else
-        #ifdef __APPLE__
-            int buf_length = static_cast<int>(strnlen(str->c_str(), buf_sz));
-        #else
-            int buf_length = static_cast<int>(strnlen_s(str->c_str(), buf_sz));
-        #endif
-    #endif
+    charge(lane);
+    remove_from(lane, true);
+}
+
+Queue_Controller::Read_Result Queue_Controller::read(std::string& out, size_t max_size, char separator, int flush_prio)
+{
+    Read_Result res;
+
+    refill();
 
-    mq_size_ -= buf_length;
+    for (int lane = select_lane(); lane >= 0; lane = select_lane())
+    {
+        const Entry& entry = lanes_[lane].front();
+        if (out.size() + 1 + entry.size > max_size)
+            break;
+
+        out += separator;
+        out.append(front_data(lane), entry.size);
+
+        bool flush = (entry.prio <= flush_prio);
+
+        charge(lane);
+        remove_from(lane, true);
+        res.count++;
+
+        if (flush)
+        {
+            res.flush = true;
+            break;
+        }
+    }
+
+    return res;
 }
 
 void Queue_Controller::push(string *str)
-{   
+{
+    if (!str)
+        return;
+
+    push(str, lane(*str));
+}
+
+void Queue_Controller::push(string *str, int prio)
+{
     if (!str)
         return;
 
-    #ifdef __linux__
-    int buf_length = static_cast<int>(strnlen(str->c_str(), buf_sz));
-    #else
-        #ifdef __APPLE__
-            int buf_length = static_cast<int>(strnlen(str->c_str(), buf_sz));
-        #else
-            int buf_length = static_cast<int>(strnlen_s(str->c_str(), buf_sz));
-        #endif
-    #endif
+    push(str->c_str(), str->size(), prio);
+    delete str;
+}
+
+void Queue_Controller::push(const char* data, size_t size, int prio)
+{   
+    if (!data)
+        return;
 
+    if ((prio < 0) || (prio > unknown_lane))
+        prio = unknown_lane;
+
+    if (spill(data, size, prio))
+        return;
+
+    if (memory_)
+        check_memory();
 
     if (state_of_emergency())
         handle_emergency();
 
-    mq_.push(str);
-    mq_size_ += buf_length;
+    if (spill(data, size, prio))
+        return;
+
+    store(data, size, prio);
+}
+
+//Nothing could overtake messages that are already on disk, so while there are any, new messages go to disk as well
+//and those that do not fit there are dropped. Returns false if the message is for memory.
+bool Queue_Controller::spill(const char* data, size_t size, int prio)
+{
+    if (!spill_ || spill_->empty())
+        return false;
+
+    if (!spill_->push(data, size, prio))
+        dropped_[prio]++;
+
+    return true;
+}
+
+void Queue_Controller::store(const char* data, size_t size, int prio)
+{
+    Entry entry;
+    entry.size = size;
+    entry.order = next_order_++;
+    entry.enqueued = steady_clock::now();
+    entry.prio = prio;
+
+    size_t record = sizeof(Length_Header) + size;
+    std::deque<Slab>& slabs = slabs_[prio];
+
+    if (slabs.empty() || (slabs.back().capacity - slabs.back().end < record))
+        slabs.push_back(make_slab(record));
+
+    Slab& slab = slabs.back();
+    Length_Header header = static_cast<Length_Header>(size);
+
+    memcpy(slab.data.get() + slab.end, &header, sizeof(header));
+    memcpy(slab.data.get() + slab.end + sizeof(header), data, size);
+    slab.end += record;
+
+    lanes_[prio].push_back(entry);
+    mq_size_ += size;
+    selected_ = -1;
+}
+
+//Brings spilled messages back once lanes are drained below half of the size limit, they are newer than anything in lanes.
+void Queue_Controller::refill()
+{
+    if (!spill_)
+        return;
+
+    std::string str;
+    int prio = unknown_lane;
+
+    while (!spill_->empty() && ((mq_size_ < max_size_ / 2) || (mq_size_ == 0)))
+    {
+        spill_->pop(str, prio);
+        store(str.data(), str.size(), prio);
+    }
+}
+
+void Queue_Controller::tail_data(int lane, size_t count, std::vector<const char*>& data)
+{
+    data.resize(count);
+
+    auto slab(slabs_[lane].rbegin());
+    size_t pos = slab->end;
+
+    auto entry(lanes_[lane].rbegin());
+    for (size_t i = count; i > 0; --i, ++entry)
+    {
+        while (pos == slab->begin)
+        {
+            ++slab;
+            pos = slab->end;
+        }
+
+        pos -= sizeof(Length_Header) + entry->size;
+        data[i - 1] = slab->data.get() + pos + sizeof(Length_Header);
+    }
+}
+
+Queue_Controller::Slab Queue_Controller::make_slab(size_t size)
+{
+    if ((size <= slab_size) && !free_slabs_.empty())
+    {
+        Slab slab(std::move(free_slabs_.back()));
+        free_slabs_.pop_back();
+        return slab;
+    }
+
+    Slab slab;
+    slab.capacity = std::max(size, slab_size);
+    slab.data.reset(new char[slab.capacity]);
+    return slab;
+}
+
+void Queue_Controller::recycle(Slab& slab)
+{
+    if ((slab.capacity != slab_size) || (free_slabs_.size() >= max_free_slabs))
+        return;
+
+    slab.begin = 0;
+    slab.end = 0;
+    free_slabs_.push_back(std::move(slab));
+}
+
+Queue_Controller::Entry Queue_Controller::remove_from(int lane, bool oldest)
+{
+    std::deque<Entry>& mq = lanes_[lane];
+    std::deque<Slab>& slabs = slabs_[lane];
+    Entry entry;
+
+    size_t record = 0;
+
+    if (oldest)
+    {
+        entry = mq.front();
+        mq.pop_front();
+
+        record = sizeof(Length_Header) + entry.size;
+        slabs.front().begin += record;
+
+        if (slabs.front().begin == slabs.front().end)
+        {
+            recycle(slabs.front());
+            slabs.pop_front();
+        }
+    }
+    else
+    {
+        entry = mq.back();
+        mq.pop_back();
+
+        record = sizeof(Length_Header) + entry.size;
+        slabs.back().end -= record;
+
+        if (slabs.back().begin == slabs.back().end)
+        {
+            recycle(slabs.back());
+            slabs.pop_back();
+        }
+    }
+
+    mq_size_ -= entry.size;
+
+    if (mq.empty())
+        credit_[lane] = 0;
+
+    selected_ = -1;
+    return entry;
 }
 
 bool Queue_Controller::state_of_emergency()
@@ -92,8 +363,12 @@ bool Queue_Controller::state_of_emergency()
             throw std::out_of_range("emergency timout!");
     };
 
-    if (mq_size_ > (int)max_size_)
+    if (mq_size_ > max_size_)
     {
+        //memory would not wait for the timeout
+        if (memory_pressure_)
+            return true;
+
         if (timer_start_ == time_point<system_clock, system_clock::duration>(chrono::milliseconds(0)))
             timer_start_ = system_clock::now();
 
@@ -112,113 +387,78 @@ bool Queue_Controller::state_of_emergency()
     return false;
 }
 
-void Queue_Controller::handle_emergency()
+void Queue_Controller::check_memory()
 {
-    Algo::Result res = algo_->process_queue(mq_size_);
-    mq_size_ = static_cast<int>(res.current_size);
+    auto now = steady_clock::now();
+    if (now - memory_checked_ < milliseconds(memory_check_interval_))
+        return;
 
-    if (state_of_emergency())
-        res = algo_fallback_->process_queue(mq_size_);
+    memory_checked_ = now;
 
-    mq_size_ = static_cast<int>(res.current_size);
+    size_t budget = 0;
+    memory_pressure_ = memory_->queue_budget(mq_size_, memory_reported_, budget) && (budget < configured_max_size_);
+    max_size_ = memory_pressure_ ? budget : configured_max_size_;
 }
 
-Queue_Controller::Algo::Result Queue_Controller::Remove_Oldest::process_queue(size_t current_size)
+void Queue_Controller::handle_emergency()
 {
-    Result res;
-    res.current_size = 0;
-    res.removed_count = 0;
-    
-    int cs = static_cast<int>(current_size);
-    
-    while (cs >= (int)max_size_)
-    {
-        if (mq_.empty())
-            break;
-            
-        string* str = mq_.front();
-        mq_.pop();
+    algo_->process_queue(mq_size_);
 
-        if (str)
-        {
-            #ifdef __linux__
-            int buf_length = static_cast<int>(strnlen(str->c_str(), buf_sz));
-            #else
-                #ifdef __APPLE__
-                    int buf_length = static_cast<int>(strnlen(str->c_str(), buf_sz));
-                #else
-                    int buf_length = static_cast<int>(strnlen_s(str->c_str(), buf_sz));
-                #endif
-            #endif
-        
-            cs -= buf_length;
-        }
-
-        res.removed_count++;
-
-        delete str;
-    }
-    
-    if (cs < 0)
-        cs = 0;
-
-    res.current_size = cs;
-    return res;
+    if (state_of_emergency())
+        algo_fallback_->process_queue(mq_size_);
 }
 
-Queue_Controller::Algo::Result Queue_Controller::Remove_Newest::process_queue(size_t current_size)
+Queue_Controller::Algo::Result Queue_Controller::Algo::remove(unsigned short lanes_mask, bool oldest, bool by_priority)
 {
     Result res;
     res.current_size = 0;
     res.removed_count = 0;
-    
-    int cs = static_cast<int>(current_size);
 
-    vector<string*> v;
-    while (!mq_.empty())
+    while (qc_.mq_size_ >= qc_.max_size_)
     {
-        v.push_back(mq_.front());
-        mq_.pop();
-    }
+        int lane = -1;
 
-    while (cs >= (int)max_size_)
-    {
-        if (v.empty())
-            break;
+        for (int i = lane_count - 1; i >= 0; --i)
+        {
+            if (!(lanes_mask & (1 << i)) || qc_.lanes_[i].empty())
+                continue;
+
+            if (by_priority)
+            {
+                lane = i;
+                break;
+            }
 
-        string* str = v.back();
-        v.pop_back();
+            if (lane < 0)
+            {
+                lane = i;
+                continue;
+            }
 
-        if (str)
-        {
-            #ifdef __linux__
-            int buf_length = static_cast<int>(strnlen(str->c_str(), buf_sz));
-            #else
-                #ifdef __APPLE__
-                    int buf_length = static_cast<int>(strnlen(str->c_str(), buf_sz));
-                #else
-                    int buf_length = static_cast<int>(strnlen_s(str->c_str(), buf_sz));
-                #endif
-            #endif
-
-            cs -= buf_length;
+            if (oldest ? (qc_.lanes_[i].front().order < qc_.lanes_[lane].front().order) :
+                         (qc_.lanes_[i].back().order > qc_.lanes_[lane].back().order))
+                lane = i;
         }
 
-        res.removed_count++;
+        if (lane < 0)
+            break;
 
-        delete str;
+        qc_.dropped_[qc_.remove_from(lane, oldest).prio]++;
+        res.removed_count++;
     }
 
-    for (vector<string*>::iterator it(v.begin()); it != v.end(); ++it)
-    {
-        mq_.push(*it);
-    }
+    res.current_size = qc_.mq_size_;
+    return res;
+}
 
-    if (cs < 0)
-        cs = 0;
+Queue_Controller::Algo::Result Queue_Controller::Remove_Oldest::process_queue(size_t /*current_size*/)
+{
+    return remove((1 << lane_count) - 1, true, false);
+}
 
-    res.current_size = cs;
-    return res;
+Queue_Controller::Algo::Result Queue_Controller::Remove_Newest::process_queue(size_t /*current_size*/)
+{
+    return remove((1 << lane_count) - 1, false, false);
 }
 
 void Queue_Controller::Remove_Oldest_Below_Priority::make_filter()
@@ -227,58 +467,10 @@ void Queue_Controller::Remove_Oldest_Below_Priority::make_filter()
     filter_->add_all_below(prio_.c_str(), inclusive_);
 }
 
-Queue_Controller::Algo::Result Queue_Controller::Remove_Oldest_Below_Priority::process_queue(size_t current_size)
+//Messages without priority never pass the filter, so their lane is not touched here.
+Queue_Controller::Algo::Result Queue_Controller::Remove_Oldest_Below_Priority::process_queue(size_t /*current_size*/)
 {
-    Result res;
-    res.current_size = 0;
-    res.removed_count = 0;
-    
-    std::queue<std::string*> mq;
-    
-    int cs = static_cast<int>(current_size);
-    
-    while (!mq_.empty())
-    {
-        string* str = mq_.front();
-
-        if (str)
-        {
-            if (cs >= (int)max_size_)
-            {
-                #ifdef __linux__
-                int buf_length = static_cast<int>(strnlen(str->c_str(), buf_sz));
-                #else
-                    #ifdef __APPLE__
-                        int buf_length = static_cast<int>(strnlen(str->c_str(), buf_sz));
-                    #else
-                        int buf_length = static_cast<int>(strnlen_s(str->c_str(), buf_sz));
-                    #endif
-                #endif
-
-                fplog::Message msg(*str);
-                if (filter_->should_pass(msg))
-                {
-                    cs -= buf_length;
-                    res.removed_count++;
-                    delete str;
-                }
-                else
-                    mq.push(str);
-            }
-            else
-                mq.push(str);
-        }
-        
-        mq_.pop();
-    }
-
-    mq_ = mq;
-    
-    if (cs < 0)
-        cs = 0;
-
-    res.current_size = cs;
-    return res;
+    return remove(filter_->level_mask(), true, true);
 }
 
 void Queue_Controller::Remove_Newest_Below_Priority::make_filter()
@@ -287,83 +479,107 @@ void Queue_Controller::Remove_Newest_Below_Priority::make_filter()
     filter_->add_all_below(prio_.c_str(), inclusive_);
 }
 
-Queue_Controller::Algo::Result Queue_Controller::Remove_Newest_Below_Priority::process_queue(size_t current_size)
+Queue_Controller::Algo::Result Queue_Controller::Remove_Newest_Below_Priority::process_queue(size_t /*current_size*/)
+{
+    return remove(filter_->level_mask(), false, true);
+}
+
+Queue_Controller::Spill_To_Disk::Spill_To_Disk(Queue_Controller& qc, const char* dir, size_t max_size):
+Algo(qc),
+store_(std::make_shared<Spill_Store>(dir ? dir : "", max_size))
+{
+}
+
+//Moves newest messages to disk, oldest first, until the queue is below half of its size limit or disk budget is used up.
+//Spilled messages are still in the queue, so they are not reported as removed.
+Queue_Controller::Algo::Result Queue_Controller::Spill_To_Disk::process_queue(size_t /*current_size*/)
 {
     Result res;
-    res.current_size = 0;
-    res.removed_count = 0;
-    
-    std::vector<std::string*> v;
-    
-    for (std::string* str = 0; !mq_.empty(); mq_.pop())
-    {
-        str = mq_.front();
-        if (!str)
-            continue;
-        v.push_back(str);
-    }
 
-    for (std::vector<std::string*>::reverse_iterator it(v.rbegin()); it != v.rend(); ++it)
-        mq_.push(*it);
+    if (!qc_.spill_ || qc_.spill_->empty())
+        qc_.spill_ = store_;
 
-    {
-        std::vector<std::string*> empty;
-        v.swap(empty);
-    }
+    Spill_Store& store = *qc_.spill_;
 
-    int cs = static_cast<int>(current_size);
-    
-    while (!mq_.empty())
-    {
-        string* str = mq_.front();
+    size_t counts[lane_count] = {};
+    size_t total = 0, disk = 0, available = store.available();
 
-        if (str)
+    for (size_t remaining = qc_.mq_size_; remaining > qc_.max_size_ / 2; ++total)
+    {
+        int lane = -1;
+        for (int i = 0; i < lane_count; ++i)
         {
+            std::deque<Entry>& mq = qc_.lanes_[i];
+            if (counts[i] == mq.size())
+                continue;
 
-            if (cs >= (int)max_size_)
-            {
-                #ifdef __linux__
-                int buf_length = static_cast<int>(strnlen(str->c_str(), buf_sz));
-                #else
-                    #ifdef __APPLE__
-                        int buf_length = static_cast<int>(strnlen(str->c_str(), buf_sz));
-                    #else
-                        int buf_length = static_cast<int>(strnlen_s(str->c_str(), buf_sz));
-                    #endif
-                #endif
-
-                fplog::Message msg(*str);
-                if (filter_->should_pass(msg))
-                {
-                    cs -= buf_length;
-                    res.removed_count++;
-                    delete str;
-                }
-                else
-                    v.push_back(str);
-            }
-            else
-                v.push_back(str);
+            if ((lane < 0) || (mq[mq.size() - 1 - counts[i]].order > qc_.lanes_[lane][qc_.lanes_[lane].size() - 1 - counts[lane]].order))
+                lane = i;
         }
 
-        mq_.pop();
+        if (lane < 0)
+            break;
+
+        const Entry& entry = qc_.lanes_[lane][qc_.lanes_[lane].size() - 1 - counts[lane]];
+        if (disk + Spill_Store::record_size(entry.size) > available)
+            break;
+
+        disk += Spill_Store::record_size(entry.size);
+        remaining -= entry.size;
+        counts[lane]++;
     }
 
-    for (std::vector<std::string*>::reverse_iterator it(v.rbegin()); it != v.rend(); ++it)
-        mq_.push(*it);
+    if (!total || !store.reserve(disk))
+    {
+        res.current_size = qc_.mq_size_;
+        return res;
+    }
+
+    std::vector<const char*> data[lane_count];
+    size_t written[lane_count] = {};
+
+    for (int i = 0; i < lane_count; ++i)
+        if (counts[i])
+            qc_.tail_data(i, counts[i], data[i]);
 
+    for (size_t n = 0; n < total; ++n)
     {
-        std::vector<std::string*> empty;
-        v.swap(empty);
+        int lane = -1;
+        for (int i = 0; i < lane_count; ++i)
+        {
+            if (written[i] == counts[i])
+                continue;
+
+            std::deque<Entry>& mq = qc_.lanes_[i];
+            if ((lane < 0) || (mq[mq.size() - counts[i] + written[i]].order <
+                               qc_.lanes_[lane][qc_.lanes_[lane].size() - counts[lane] + written[lane]].order))
+                lane = i;
+        }
+
+        std::deque<Entry>& mq = qc_.lanes_[lane];
+        const Entry& entry = mq[mq.size() - counts[lane] + written[lane]];
+
+        store.push(data[lane][written[lane]], entry.size, entry.prio);
+        written[lane]++;
     }
 
-    if (cs < 0)
-        cs = 0;
+    for (int i = 0; i < lane_count; ++i)
+        for (size_t n = 0; n < counts[i]; ++n)
+            qc_.remove_from(i, false);
 
-    res.current_size = cs;
+    res.current_size = qc_.mq_size_;
     return res;
 }
 
+void Queue_Controller::collect_drops(unsigned long long (&counts)[lane_count])
+{
+    for (int i = 0; i < lane_count; ++i)
+    {
+        counts[i] += dropped_[i];
+        dropped_[i] = 0;
+    }
+}
+
 void Queue_Controller::change_algo(shared_ptr<Algo> algo, Algo::Fallback_Options::Type fallback_algo)
 {
     algo_ = algo;
@@ -378,6 +594,9 @@ void Queue_Controller::change_algo(shared_ptr<Algo> algo, Algo::Fallback_Options
 void Queue_Controller::change_params(size_t size_limit, size_t timeout)
 {
     max_size_ = size_limit;
+    configured_max_size_ = size_limit;
+    memory_pressure_ = false;
+    memory_checked_ = steady_clock::time_point();
     emergency_time_trigger_ = timeout;
 }
 
@@ -393,6 +612,7 @@ shared_ptr<Queue_Controller::Algo> Queue_Controller::make_algo(const std::string
     }
 
     algos["remove_oldest"] = make_shared<Remove_Oldest>(*this);
+    algos["spill_to_disk"] = make_shared<Spill_To_Disk>(*this, spill_dir_.c_str(), spill_max_size_);
     algos["remove_newest"] = make_shared<Remove_Newest>(*this);
 
     std::map<std::string, shared_ptr<Queue_Controller::Algo>>::iterator it(algos.find(name));
@@ -407,6 +627,9 @@ void Queue_Controller::apply_config(const sprot::Params& params)
     std::string emergency_prio;
     std::string emergency_algo;
     std::string emergency_fallback_algo;
+
+    std::string memory_dir(memory_ ? memory_->dir() : std::string());
+    bool memory_changed = false;
     
     std::vector<std::string> prios;
     
@@ -426,6 +649,8 @@ void Queue_Controller::apply_config(const sprot::Params& params)
             if (generic_util::find_str_no_case(param.first, "max_queue_size"))
             {
                 max_size_ = std::stoul(param.second);
+                configured_max_size_ = max_size_;
+                memory_pressure_ = false;
             }
 
             if (generic_util::find_str_no_case(param.first, "emergency_timeout"))
@@ -458,9 +683,37 @@ void Queue_Controller::apply_config(const sprot::Params& params)
                 {
                     if (!generic_util::find_str_no_case(emergency_algo, "remove_oldest"))
                         if (!generic_util::find_str_no_case(emergency_algo, "remove_newest"))
-                            emergency_algo.clear();
+                            if (!generic_util::find_str_no_case(emergency_algo, "spill_to_disk"))
+                                emergency_algo.clear();
                 }
             }
+
+            if (generic_util::find_str_no_case(param.first, "spill_dir"))
+            {
+                spill_dir_ = param.second;
+            }
+
+            if (generic_util::find_str_no_case(param.first, "spill_max_size"))
+            {
+                spill_max_size_ = std::stoul(param.second);
+            }
+
+            if (generic_util::find_str_no_case(param.first, "memory_limit_dir"))
+            {
+                memory_dir = param.second;
+                memory_changed = true;
+            }
+
+            if (generic_util::find_str_no_case(param.first, "memory_limit_share"))
+            {
+                memory_share_ = std::stoul(param.second);
+                memory_changed = true;
+            }
+
+            if (generic_util::find_str_no_case(param.first, "memory_check_interval"))
+            {
+                memory_check_interval_ = std::stoul(param.second);
+            }
         }
         catch (std::exception&)
         {
@@ -477,4 +730,20 @@ void Queue_Controller::apply_config(const sprot::Params& params)
     {
         algo_ = make_algo(emergency_algo, emergency_prio);
     }
+
+    if (memory_changed)
+    {
+        if (memory_)
+            memory_->release(memory_reported_);
+
+        if (memory_dir.empty())
+            memory_.reset();
+        else
+            memory_ = Memory_Budget::shared(memory_dir, memory_share_);
+
+        max_size_ = configured_max_size_;
+        memory_pressure_ = false;
+    }
+
+    memory_checked_ = steady_clock::time_point();
 }
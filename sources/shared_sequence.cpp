@@ -0,0 +1,99 @@
+#include <shared_sequence.h>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+namespace sequence_number {
+
+//counter gets its own cache line so that nothing else mapped nearby is invalidated on every increment
+struct alignas(64) Shared_Counter
+{
+    std::atomic<unsigned long long> value;
+};
+
+static_assert(std::atomic<unsigned long long>::is_always_lock_free, "shared sequence counter requires lock-free 64-bit atomics");
+
+static Shared_Counter* map_shared_counter()
+{
+    bool created = true;
+    int fd = shm_open(sequence_shm_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+
+    if ((fd == -1) && (errno == EEXIST))
+    {
+        created = false;
+        fd = shm_open(sequence_shm_name, O_RDWR, 0);
+    }
+
+    if (fd == -1)
+        return nullptr;
+
+    //processes with restrictive umask should not lock others out of the counter
+    if (created)
+        fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+
+    //new segment has zero size, growing it fills the counter with zeroes, so there is no
+    //initialization race - if several processes do this at the same time result is the same
+    struct stat st;
+    if ((fstat(fd, &st) == -1) || ((st.st_size < static_cast<off_t>(sizeof(Shared_Counter))) && (ftruncate(fd, sizeof(Shared_Counter)) == -1)))
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    void* addr = mmap(nullptr, sizeof(Shared_Counter), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED)
+        return nullptr;
+
+    return static_cast<Shared_Counter*>(addr);
+}
+
+static std::atomic<unsigned long long> g_lease_size(0);
+
+//block of numbers [next, end) taken from the shared counter by the calling thread
+struct Sequence_Lease
+{
+    unsigned long long next = 0;
+    unsigned long long end = 0;
+};
+
+static thread_local Sequence_Lease g_lease;
+
+unsigned long long read_sequence_number()
+{
+    static Shared_Counter* counter = map_shared_counter();
+
+    if (!counter)
+        return 0;
+
+    unsigned long long lease_size = g_lease_size.load(std::memory_order_relaxed);
+
+    if (lease_size == 0)
+        return counter->value.fetch_add(1, std::memory_order_relaxed) + 1;
+
+    if (g_lease.next < g_lease.end)
+        return g_lease.next++;
+
+    unsigned long long first = counter->value.fetch_add(lease_size, std::memory_order_relaxed) + 1;
+
+    g_lease.next = first + 1;
+    g_lease.end = first + lease_size;
+
+    return first;
+}
+
+void set_lease_size(unsigned long long size)
+{
+    g_lease_size = size;
+}
+
+unsigned long long get_lease_size()
+{
+    return g_lease_size;
+}
+
+};
@@ -0,0 +1,160 @@
+#include <spill_store.h>
+#include <atomic>
+#include <algorithm>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static std::atomic<unsigned long long> g_store_count(0);
+
+Spill_Store::Spill_Store(const std::string& dir, size_t max_size, size_t segment_size):
+dir_(dir.empty() ? std::string(".") : dir),
+segment_size_(std::max(segment_size, sizeof(Record_Header))),
+id_(g_store_count++)
+{
+    max_segments_ = std::max<size_t>(1, (max_size + segment_size_ - 1) / segment_size_);
+}
+
+Spill_Store::~Spill_Store()
+{
+    while (!segments_.empty())
+        drop_segment();
+}
+
+size_t Spill_Store::available() const
+{
+    unsigned long long first = segments_.empty() ? write_pos_ : segments_.front().base;
+    return static_cast<size_t>(max_segments_ * segment_size_ - (write_pos_ - first));
+}
+
+bool Spill_Store::push(const char* data, size_t size, int prio)
+{
+    size_t record = record_size(size);
+    if ((record > available()) || (size > 0xFFFFFFFF))
+        return false;
+
+    //segments are created up front, so that a failure does not leave half of the record behind
+    if (!reserve(record))
+        return false;
+
+    Record_Header header;
+    header.size = static_cast<unsigned int>(size);
+    header.prio = prio;
+
+    write(reinterpret_cast<const char*>(&header), sizeof(header));
+    write(data, size);
+
+    return true;
+}
+
+bool Spill_Store::reserve(size_t size)
+{
+    if (size > available())
+        return false;
+
+    unsigned long long end = segments_.empty() ? write_pos_ : segments_.back().base + segment_size_;
+    while (end - write_pos_ < size)
+    {
+        if (!add_segment())
+            return false;
+
+        end += segment_size_;
+    }
+
+    return true;
+}
+
+bool Spill_Store::pop(std::string& out, int& prio)
+{
+    if (empty())
+        return false;
+
+    Record_Header header;
+    read(reinterpret_cast<char*>(&header), sizeof(header));
+
+    out.resize(header.size);
+    if (header.size)
+        read(&out[0], header.size);
+
+    prio = header.prio;
+    return true;
+}
+
+bool Spill_Store::add_segment()
+{
+    Segment segment;
+    segment.path = dir_ + "/fplog_spill_" + std::to_string(getpid()) + "_" + std::to_string(id_) + "_" + std::to_string(next_segment_++) + ".seg";
+    segment.base = segments_.empty() ? write_pos_ : segments_.back().base + segment_size_;
+
+    int fd = open(segment.path.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        return false;
+
+    void* addr = MAP_FAILED;
+    if (ftruncate(fd, static_cast<off_t>(segment_size_)) == 0)
+        addr = mmap(nullptr, segment_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (addr == MAP_FAILED)
+    {
+        unlink(segment.path.c_str());
+        return false;
+    }
+
+    segment.addr = static_cast<char*>(addr);
+    segments_.push_back(segment);
+
+    return true;
+}
+
+void Spill_Store::drop_segment()
+{
+    Segment& segment = segments_.front();
+
+    munmap(segment.addr, segment_size_);
+    unlink(segment.path.c_str());
+
+    segments_.pop_front();
+}
+
+void Spill_Store::write(const char* data, size_t size)
+{
+    for (auto it(segments_.begin()); size > 0; ++it)
+    {
+        unsigned long long end = it->base + segment_size_;
+        if (write_pos_ >= end)
+            continue;
+
+        size_t offset = static_cast<size_t>(write_pos_ - it->base);
+        size_t chunk = std::min(size, segment_size_ - offset);
+
+        memcpy(it->addr + offset, data, chunk);
+
+        data += chunk;
+        size -= chunk;
+        write_pos_ += chunk;
+    }
+}
+
+void Spill_Store::read(char* data, size_t size)
+{
+    while (size > 0)
+    {
+        Segment& segment = segments_.front();
+
+        size_t offset = static_cast<size_t>(read_pos_ - segment.base);
+        size_t chunk = std::min(size, segment_size_ - offset);
+
+        memcpy(data, segment.addr + offset, chunk);
+
+        data += chunk;
+        size -= chunk;
+        read_pos_ += chunk;
+
+        if (read_pos_ == segment.base + segment_size_)
+            drop_segment();
+    }
+}
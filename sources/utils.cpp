@@ -443,11 +443,16 @@ std::string timezone_from_minutes_to_iso8601(int tz_minute_bias)
 }
 
 
+std::string get_iso8601_timestamp()
+{
+    return get_iso8601_timestamp(std::chrono::system_clock::now());
+}
+
 #ifdef _WIN32
 
-std::string get_iso8601_timestamp()
+std::string get_iso8601_timestamp(std::chrono::system_clock::time_point tp)
 {
-    time_t elapsed_time(time(0));
+    time_t elapsed_time(std::chrono::system_clock::to_time_t(tp));
     struct tm* tm(localtime(&elapsed_time));
     char timestamp[200] = {0};
 
@@ -463,7 +468,8 @@ std::string get_iso8601_timestamp()
     }
 
     snprintf(timestamp, sizeof(timestamp) - 1, "%04d-%02d-%02dT%02d:%02d:%02d.%03lld%s",
-        tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec, get_msec_time() % 1000,
+        tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec,
+        static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(tp.time_since_epoch()).count() % 1000),
         timezone_from_minutes_to_iso8601(tz).c_str());
 
     return timestamp;
@@ -471,10 +477,8 @@ std::string get_iso8601_timestamp()
     
 #else
 
-std::string get_iso8601_timestamp()
+std::string get_iso8601_timestamp(std::chrono::system_clock::time_point tp)
 {
-    auto tp(std::chrono::system_clock::now());
-
     std::string tz_only(date::format("%z", tp));
     std::string datetime(date::format("%FT%T", tp));
 